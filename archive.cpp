@@ -0,0 +1,462 @@
+#include "archive.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <lzma.h>
+
+/* Copies n bits from bit from of src to bit to of dst */
+static void copy_bits(uint8_t *dst, uint64_t to, const uint8_t *src,
+        uint64_t from, uint64_t n) {
+    for (; n && to % 8; n--, to++, from++)
+        dst[to / 8] = (dst[to / 8] & ~(1 << to % 8)) |
+            (src[from / 8] >> from % 8 & 1) << to % 8;
+    if (from % 8 == 0) {
+        memcpy(dst + to / 8, src + from / 8, n / 8);
+    } else {
+        uint64_t i;
+        int shift = from % 8;
+        for (i = 0; i < n / 8; i++)
+            dst[to / 8 + i] = src[from / 8 + i] >> shift |
+                src[from / 8 + i + 1] << (8 - shift);
+    }
+    to += n / 8 * 8;
+    from += n / 8 * 8;
+    for (n %= 8; n; n--, to++, from++)
+        dst[to / 8] = (dst[to / 8] & ~(1 << to % 8)) |
+            (src[from / 8] >> from % 8 & 1) << to % 8;
+}
+
+/* Copies n bits from bit from of the plotted field of a dense row major s
+ * to the start of dst. The words at either end of a slab are shared with
+ * the neighbouring slabs, which traversals may still be plotting in, so
+ * every word is loaded atomically */
+static void load_plotted(uint8_t *dst, const subspace *s, uint64_t from,
+        uint64_t n) {
+    uint64_t i, bit, len, word;
+    for (i = 0; i < n; i += len) {
+        bit = (from + i) % 64;
+        len = 64 - bit < n - i ? 64 - bit : n - i;
+        word = __atomic_load_n(&s->plotted[(from + i) / 64],
+                __ATOMIC_RELAXED) >> bit;
+        copy_bits(dst, i, (const uint8_t *)&word, 0, len);
+    }
+}
+
+static int write_all(int fd, const void *buf, size_t n, uint64_t offset) {
+    const uint8_t *p = (const uint8_t *)buf;
+    while (n) {
+        ssize_t written = pwrite(fd, p, n, offset);
+        if (written <= 0)
+            return 0;
+        p += written;
+        n -= written;
+        offset += written;
+    }
+    return 1;
+}
+
+static int read_all(int fd, void *buf, size_t n, uint64_t offset) {
+    uint8_t *p = (uint8_t *)buf;
+    while (n) {
+        ssize_t got = pread(fd, p, n, offset);
+        if (got <= 0)
+            return 0;
+        p += got;
+        n -= got;
+        offset += got;
+    }
+    return 1;
+}
+
+/* Creates an archive for the given bounds, in slabs of slab_width planes,
+ * ARCHIVE_SLAB_WIDTH if 0. Returns NULL if the file cannot be created */
+archive *archive_create(const char *path, int64_t x_min, int64_t y_min,
+        int64_t z_min, int64_t x_max, int64_t y_max, int64_t z_max,
+        int64_t slab_width) {
+    archive *a = (archive *)malloc(sizeof(archive));
+    if (!a)
+        return NULL;
+    a->x_min = x_min;
+    a->y_min = y_min;
+    a->z_min = z_min;
+    a->x_max = x_max;
+    a->y_max = y_max;
+    a->z_max = z_max;
+    a->slab_width = slab_width > 0 ? slab_width : ARCHIVE_SLAB_WIDTH;
+    a->end = sizeof(archive_header);
+    a->failed = 0;
+    a->slabs = (slab_entry *)calloc(num_slabs(a) + 1, sizeof(slab_entry));
+    a->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (!a->slabs || a->fd < 0) {
+        if (a->fd >= 0)
+            close(a->fd);
+        free(a->slabs);
+        free(a);
+        return NULL;
+    }
+    pthread_mutex_init(&a->lock, NULL);
+    return a;
+}
+
+/* Compresses the slab and appends it. bits holds the slab's points, row
+ * major */
+static int write_slab(archive *a, int64_t slab, const uint8_t *bits,
+        size_t bytes) {
+    size_t i, size = 0;
+    for (i = 0; i < bytes && !bits[i]; i++);
+    if (i == bytes) {
+        a->slabs[slab].offset = a->slabs[slab].size = 0;
+        return 1;
+    }
+    size_t bound = lzma_stream_buffer_bound(bytes);
+    uint8_t *out = (uint8_t *)malloc(bound);
+    if (!out || lzma_easy_buffer_encode(ARCHIVE_PRESET, LZMA_CHECK_CRC32,
+                NULL, bits, bytes, out, &size, bound) != LZMA_OK) {
+        free(out);
+        __atomic_store_n(&a->failed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    pthread_mutex_lock(&a->lock);
+    uint64_t offset = a->end;
+    a->end += size;
+    a->slabs[slab].offset = offset;
+    a->slabs[slab].size = size;
+    pthread_mutex_unlock(&a->lock);
+    int ok = write_all(a->fd, out, size, offset);
+    free(out);
+    if (!ok)
+        __atomic_store_n(&a->failed, 1, __ATOMIC_RELAXED);
+    return ok;
+}
+
+/* Writes the slab holding plane x from s, which must have the bounds of
+ * the archive. A slab can be written once no traversal will plot in it
+ * anymore, while others are still running, and different slabs may be
+ * written from different threads at once. Returns 1 on success */
+int archive_write_slab(archive *a, const subspace *s, int64_t x) {
+    if (s->x_min != a->x_min || s->y_min != a->y_min ||
+            s->z_min != a->z_min || s->x_max != a->x_max ||
+            s->y_max != a->y_max || s->z_max != a->z_max ||
+            x < a->x_min || x >= a->x_max)
+        return 0;
+    int64_t slab = (x - a->x_min) / a->slab_width;
+    int64_t from = a->x_min + slab * a->slab_width;
+    int64_t to = from + a->slab_width < a->x_max ?
+        from + a->slab_width : a->x_max;
+    size_t bytes = (slab_bits(a, to - from) + 7) / 8;
+    uint8_t *bits = (uint8_t *)calloc(bytes, sizeof(uint8_t));
+    if (!bits) {
+        __atomic_store_n(&a->failed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (!s->bricks && !s->brick_shift) {
+        /* row major, so the slab is one run of bits */
+        load_plotted(bits, s, _index(s, from, s->y_min, s->z_min),
+                slab_bits(a, to - from));
+    } else {
+        uint64_t i = 0;
+        int64_t px, py, pz;
+        for (px = from; px < to; px++)
+            for (py = s->y_min; py < s->y_max; py++)
+                for (pz = s->z_min; pz < s->z_max; pz++, i++)
+                    if (plotted_point(s, _index(s, px, py, pz)))
+                        bits[i / 8] |= 1 << i % 8;
+    }
+    int ok = write_slab(a, slab, bits, bytes);
+    free(bits);
+    return ok;
+}
+
+/* Writes every slab of f, which must have the bounds of the archive */
+int archive_write_frozen(archive *a, const frozen_subspace *f) {
+    if (f->x_min != a->x_min || f->y_min != a->y_min ||
+            f->z_min != a->z_min || f->x_max != a->x_max ||
+            f->y_max != a->y_max || f->z_max != a->z_max)
+        return 0;
+    uint8_t *bits = (uint8_t *)malloc((slab_bits(a, a->slab_width) + 7) / 8);
+    if (!bits) {
+        __atomic_store_n(&a->failed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    int64_t slab, from, to;
+    int ok = 1;
+    for (slab = 0; ok && slab < num_slabs(a); slab++) {
+        from = a->x_min + slab * a->slab_width;
+        to = from + a->slab_width < a->x_max ?
+            from + a->slab_width : a->x_max;
+        size_t bytes = (slab_bits(a, to - from) + 7) / 8;
+        memset(bits, 0, bytes);
+        if (!f->brick_shift) {
+            copy_bits(bits, 0, f->points, _index(f, from, f->y_min,
+                        f->z_min), slab_bits(a, to - from));
+        } else {
+            uint64_t i = 0;
+            int64_t px, py, pz;
+            for (px = from; px < to; px++)
+                for (py = f->y_min; py < f->y_max; py++)
+                    for (pz = f->z_min; pz < f->z_max; pz++, i++)
+                        if (frozen_point(f, _index(f, px, py, pz)))
+                            bits[i / 8] |= 1 << i % 8;
+        }
+        ok = write_slab(a, slab, bits, bytes);
+    }
+    free(bits);
+    return ok;
+}
+
+/* Writes the index and header and frees a. Returns 1 if every write
+ * succeeded */
+int archive_close(archive *a) {
+    archive_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+    header.x_min = a->x_min;
+    header.y_min = a->y_min;
+    header.z_min = a->z_min;
+    header.x_max = a->x_max;
+    header.y_max = a->y_max;
+    header.z_max = a->z_max;
+    header.slab_width = a->slab_width;
+    header.index = a->end;
+    int ok = !__atomic_load_n(&a->failed, __ATOMIC_RELAXED) &&
+        write_all(a->fd, a->slabs, num_slabs(a) * sizeof(slab_entry),
+                a->end) &&
+        write_all(a->fd, &header, sizeof(header), 0);
+    ok = !close(a->fd) && ok;
+    pthread_mutex_destroy(&a->lock);
+    free(a->slabs);
+    free(a);
+    return ok;
+}
+
+/* Nonzero if the bounds and slabs of header are ordered, its slabs and
+ * their bits can be counted, and its index lies within a file of size
+ * bytes */
+static int archive_header_valid(const archive_header *header,
+        uint64_t size) {
+    uint64_t bits, slabs, index_bytes;
+    if (memcmp(header->magic, ARCHIVE_MAGIC, sizeof(header->magic)) ||
+            header->x_max < header->x_min || header->y_max < header->y_min ||
+            header->z_max < header->z_min || header->slab_width <= 0 ||
+            header->index < sizeof(archive_header) || header->index > size)
+        return 0;
+    slabs = num_slabs(header);
+    if (__builtin_mul_overflow((uint64_t)header->slab_width,
+                (uint64_t)(header->y_max - header->y_min), &bits) ||
+            __builtin_mul_overflow(bits,
+                (uint64_t)(header->z_max - header->z_min), &bits) ||
+            bits > SIZE_MAX - 8 ||
+            __builtin_mul_overflow(slabs, sizeof(slab_entry), &index_bytes))
+        return 0;
+    return index_bytes <= size - header->index;
+}
+
+/* Reads the planes x_min <= x < x_max of an archive, clipped to its
+ * bounds, into a new row major frozen_subspace. Only the slabs overlapping
+ * the range are read and decompressed. A range outside of the archive
+ * gives a subspace without planes. Returns NULL on failure, and if the
+ * header, index or a slab of the file is corrupt */
+frozen_subspace *archive_read(const char *path, int64_t x_min,
+        int64_t x_max) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    archive_header a;
+    struct stat st;
+    frozen_subspace *f = NULL;
+    slab_entry *slabs = NULL;
+    uint8_t *packed = NULL, *bits = NULL;
+    if (!read_all(fd, &a, sizeof(a), 0) || fstat(fd, &st) ||
+            !archive_header_valid(&a, st.st_size))
+        goto fail;
+    slabs = (slab_entry *)malloc((num_slabs(&a) + 1) * sizeof(slab_entry));
+    if (!slabs || !read_all(fd, slabs, num_slabs(&a) * sizeof(slab_entry),
+                a.index))
+        goto fail;
+
+    f = (frozen_subspace *)malloc(sizeof(frozen_subspace));
+    if (!f)
+        goto fail;
+    /* clamp the range to the archive, empty if they do not overlap */
+    f->x_min = x_min < a.x_min ? a.x_min : x_min > a.x_max ? a.x_max : x_min;
+    f->x_max = x_max < f->x_min ? f->x_min : x_max > a.x_max ? a.x_max :
+        x_max;
+    f->y_min = a.y_min;
+    f->z_min = a.z_min;
+    f->y_max = a.y_max;
+    f->z_max = a.z_max;
+    f->brick_shift = f->table_shift = 0;
+    f->pyramid = NULL;
+    f->levels = 0;
+    f->mapping = NULL;
+    f->mapped = 0;
+    f->points = (uint8_t *)calloc((volume(f) + 7) / 8 + 1, sizeof(uint8_t));
+    bits = (uint8_t *)malloc((slab_bits(&a, a.slab_width) + 7) / 8 + 1);
+    if (!f->points || !bits)
+        goto fail;
+
+    int64_t slab;
+    for (slab = (f->x_min - a.x_min) / a.slab_width;
+            f->x_min < f->x_max && slab < num_slabs(&a) &&
+            a.x_min + slab * a.slab_width < f->x_max; slab++) {
+        if (!slabs[slab].size)
+            continue;
+        if (slabs[slab].offset < sizeof(archive_header) ||
+                slabs[slab].offset > a.index ||
+                slabs[slab].size > a.index - slabs[slab].offset)
+            goto fail;
+        int64_t from = a.x_min + slab * a.slab_width;
+        int64_t to = from + a.slab_width < a.x_max ?
+            from + a.slab_width : a.x_max;
+        size_t bytes = (slab_bits(&a, to - from) + 7) / 8;
+        packed = (uint8_t *)malloc(slabs[slab].size);
+        if (!packed || !read_all(fd, packed, slabs[slab].size,
+                    slabs[slab].offset))
+            goto fail;
+        uint64_t memlimit = UINT64_MAX;
+        size_t in = 0, out = 0;
+        if (lzma_stream_buffer_decode(&memlimit, 0, NULL, packed, &in,
+                    slabs[slab].size, bits, &out, bytes) != LZMA_OK ||
+                out != bytes)
+            goto fail;
+        free(packed);
+        packed = NULL;
+        /* the planes of the slab inside the range */
+        int64_t lo = from > f->x_min ? from : f->x_min;
+        int64_t hi = to < f->x_max ? to : f->x_max;
+        copy_bits(f->points, slab_bits(&a, lo - f->x_min), bits,
+                slab_bits(&a, lo - from), slab_bits(&a, hi - lo));
+    }
+    free(bits);
+    free(slabs);
+    close(fd);
+    return f;
+
+fail:
+    if (f) {
+        free(f->points);
+        free(f);
+    }
+    free(packed);
+    free(bits);
+    free(slabs);
+    close(fd);
+    return NULL;
+}
+
+/* Writes f to a frozen file, with its occupancy pyramid, which is built
+ * for the file if f has none. Returns 1 on success */
+int frozen_subspace_store(const frozen_subspace *f, const char *path) {
+    int levels = f->levels;
+    uint8_t *built = NULL;
+    if (!f->pyramid && !(built = pyramid_build(f, &levels)))
+        return 0;
+    frozen_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FROZEN_MAGIC, sizeof(header.magic));
+    header.x_min = f->x_min;
+    header.y_min = f->y_min;
+    header.z_min = f->z_min;
+    header.x_max = f->x_max;
+    header.y_max = f->y_max;
+    header.z_max = f->z_max;
+    header.brick_shift = f->brick_shift;
+    header.table_shift = f->table_shift;
+    header.points = sysconf(_SC_PAGESIZE);
+    header.levels = levels;
+    header.pyramid = header.points + (index_space(f) + 7) / 8;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0 && write_all(fd, &header, sizeof(header), 0) &&
+        write_all(fd, f->points, (index_space(f) + 7) / 8, header.points) &&
+        write_all(fd, built ? built : f->pyramid, pyramid_bytes(f),
+                header.pyramid);
+    free(built);
+    return fd >= 0 && !close(fd) && ok;
+}
+
+/* Largest brick_shift of a frozen file. Indices are 64 bits, so the 3
+ * brick_shift bits of a brick have to fit in them */
+#define MAX_BRICK_SHIFT 21
+
+/* Nonzero if the layout in header is one subspace_freeze can produce and
+ * its bits are within what a size_t can count. Frozen subspaces never have
+ * tables of bricks */
+static int frozen_header_valid(const frozen_header *header) {
+    if (header->x_max < header->x_min || header->y_max < header->y_min ||
+            header->z_max < header->z_min || header->table_shift ||
+            header->brick_shift < 0 ||
+            header->brick_shift > MAX_BRICK_SHIFT)
+        return 0;
+    uint64_t side = (uint64_t)1 << header->brick_shift, bricks = 1, n;
+    const int64_t *lo = &header->x_min, *hi = &header->x_max;
+    int a;
+    for (a = 0; a < 3; a++) {
+        n = ((uint64_t)(hi[a] - lo[a]) + side - 1) / side;
+        if (__builtin_mul_overflow(bricks, n, &bricks))
+            return 0;
+    }
+    return bricks <= (SIZE_MAX >> 3 * header->brick_shift) / 8;
+}
+
+/* Maps a frozen file into a new frozen_subspace without reading it. Its
+ * points are read only and shared with every other process mapping the
+ * same file, and pages are only read from disk once they are queried.
+ * The header is checked against the layouts subspace_freeze produces and
+ * the file against the size it implies, so that a corrupt or truncated
+ * file fails here rather than when it is queried. Returns NULL on
+ * failure */
+frozen_subspace *frozen_subspace_map(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    frozen_header header;
+    struct stat st;
+    frozen_subspace *f = (frozen_subspace *)malloc(sizeof(frozen_subspace));
+    if (!f || !read_all(fd, &header, sizeof(header), 0) ||
+            memcmp(header.magic, FROZEN_MAGIC, sizeof(header.magic)) ||
+            !header.points || header.points % sysconf(_SC_PAGESIZE) ||
+            !frozen_header_valid(&header) || fstat(fd, &st) ||
+            header.points > (uint64_t)st.st_size ||
+            header.pyramid > (uint64_t)st.st_size)
+        goto fail;
+    f->x_min = header.x_min;
+    f->y_min = header.y_min;
+    f->z_min = header.z_min;
+    f->x_max = header.x_max;
+    f->y_max = header.y_max;
+    f->z_max = header.z_max;
+    f->brick_shift = header.brick_shift;
+    f->table_shift = header.table_shift;
+    f->mapped = header.points + (index_space(f) + 7) / 8;
+    /* the pyramid follows the points and has the levels f calls for,
+     * which frozen_box and frozen_cube rely on to stay within it */
+    if (header.pyramid && (header.pyramid < f->mapped ||
+                header.levels != pyramid_levels(f)))
+        goto fail;
+    if (header.pyramid)
+        f->mapped = header.pyramid + pyramid_bytes(f);
+    if ((uint64_t)st.st_size < f->mapped)
+        goto fail;
+    f->mapping = mmap(NULL, f->mapped, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (f->mapping == MAP_FAILED) {
+        free(f);
+        return NULL;
+    }
+    f->points = (uint8_t *)f->mapping + header.points;
+    f->pyramid = NULL;
+    f->levels = 0;
+    if (header.pyramid) {
+        f->pyramid = (uint8_t *)f->mapping + header.pyramid;
+        f->levels = header.levels;
+    }
+    return f;
+
+fail:
+    free(f);
+    close(fd);
+    return NULL;
+}
@@ -0,0 +1,74 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+#include "quadric.h"
+#include <pthread.h>
+
+/* Slab archives store a frozen subspace as a sequence of slabs, each
+ * slab_width planes of constant x thick, compressed independently with
+ * LZMA. An index of slab offsets at the end of the file lets readers decode
+ * any range of x without touching the rest, and writers only ever hold one
+ * slab in memory, so slabs can be written as soon as a traversal is done
+ * with them rather than once the whole volume has been materialized.
+ *
+ * Within a slab points are row major, z fastest, whatever the layout of the
+ * subspace they came from. Slabs holding no plotted point take no space. */
+
+#define ARCHIVE_MAGIC "QSLABS1"
+#define FROZEN_MAGIC "QFROZEN"
+#define ARCHIVE_SLAB_WIDTH 16
+#define ARCHIVE_PRESET 1
+
+/* Bits in a slab of width planes, and in the last, possibly thinner, slab */
+#define slab_bits(a, width) ((uint64_t)(width) * \
+        ((a)->y_max - (a)->y_min) * ((a)->z_max - (a)->z_min))
+#define num_slabs(a) (((a)->x_max - (a)->x_min + (a)->slab_width - 1) / \
+        (a)->slab_width)
+
+typedef struct _archive_header {
+    char magic[8];
+    int64_t x_min, y_min, z_min, x_max, y_max, z_max;
+    int64_t slab_width;
+    /* Offset of the index, 0 until the archive is closed */
+    uint64_t index;
+} archive_header;
+
+/* Frozen files hold a frozen_subspace uncompressed, in its own layout, so
+ * that they can be mapped straight into memory. The points start at offset
+ * points, a multiple of the page size, and are followed by the levels
+ * levels of the occupancy pyramid at offset pyramid. Files written without
+ * a pyramid have a pyramid offset of 0 */
+typedef struct _frozen_header {
+    char magic[8];
+    int64_t x_min, y_min, z_min, x_max, y_max, z_max;
+    int64_t brick_shift, table_shift;
+    uint64_t points;
+    int64_t levels;
+    uint64_t pyramid;
+} frozen_header;
+
+/* Where a slab is stored. size is 0 for empty slabs */
+typedef struct _slab_entry {
+    uint64_t offset, size;
+} slab_entry;
+
+typedef struct _archive {
+    int fd;
+    int64_t x_min, y_min, z_min, x_max, y_max, z_max;
+    int64_t slab_width;
+    slab_entry *slabs;
+    /* Offset the next slab is written at. Writers reserve their space
+     * under the lock and write outside of it */
+    uint64_t end;
+    pthread_mutex_t lock;
+    int failed;
+} archive;
+
+archive *archive_create(const char *, int64_t, int64_t, int64_t,
+        int64_t, int64_t, int64_t, int64_t);
+int archive_write_slab(archive *, const subspace *, int64_t);
+int archive_write_frozen(archive *, const frozen_subspace *);
+int archive_close(archive *);
+frozen_subspace *archive_read(const char *, int64_t, int64_t);
+int frozen_subspace_store(const frozen_subspace *, const char *);
+frozen_subspace *frozen_subspace_map(const char *);
+#endif
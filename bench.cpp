@@ -0,0 +1,318 @@
+#include "quadric.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Benchmarks of the rasterization engines. Every case is run for a number
+ * of warmup rounds that are not recorded, then for a number of timed
+ * trials. Only the engine itself is timed: creating and freeing the
+ * subspace and finding seeds happen outside of the clock. Each case prints
+ * one record with the percentiles of the trial times and the throughput
+ * they give, as CSV with a header line or as one JSON object per line.
+ *
+ *     bench [-w warmups] [-t trials] [-j max_threads] [-r radius]...
+ *             [-e engine] [-q quadric] [-f csv|json]
+ *
+ * -r may be given several times, and -e and -q restrict the run to the
+ * engines or quadrics whose names contain their argument. Threaded engines
+ * are run with 1, 2, 4, ... max_threads threads. */
+
+#define MAX_RADII 16
+#define MAX_SEEDS 1024
+
+#define FORMAT_CSV 0
+#define FORMAT_JSON 1
+
+typedef struct _bench_quadric {
+    const char *name;
+    /* F for a radius r */
+    quadric (*make)(int64_t);
+} bench_quadric;
+
+typedef struct _engine {
+    const char *name;
+    int threaded;
+    int (*run)(subspace *, const quadric *, const vector *, size_t, int);
+} engine;
+
+typedef struct _bench_options {
+    int warmups, trials, max_threads, format;
+    int64_t radii[MAX_RADII];
+    int num_radii;
+    const char *engine, *quadric;
+} bench_options;
+
+static quadric sphere(int64_t r) {
+    quadric q = {1, 1, 1, 0, 0, 0, 0, 0, 0, -(double)(r * r)};
+    return q;
+}
+
+static quadric cone(int64_t) {
+    quadric q = {1, 1, -1, 0, 0, 0, 0, 0, 0, 0};
+    return q;
+}
+
+static quadric hyperboloid(int64_t r) {
+    quadric q = {1, 1, -1, 0, 0, 0, 0, 0, 0, -(double)(r * r / 4)};
+    return q;
+}
+
+/* Opens upwards from the bottom of the box, radius r at the top */
+static quadric paraboloid(int64_t r) {
+    quadric q = {1, 1, 0, 0, 0, 0, 0, 0, -(double)r / 2,
+        -(double)(r * r / 2)};
+    return q;
+}
+
+static int dfs_surface(subspace *s, const quadric *q, const vector *seeds,
+        size_t, int) {
+    return depth_first_surface(s, q, seeds, 1, BIAS_EXTERIOR);
+}
+
+static int bfs_surface(subspace *s, const quadric *q, const vector *seeds,
+        size_t, int) {
+    return breadth_first_surface(s, q, seeds, 1, BIAS_EXTERIOR);
+}
+
+static int dfs_fill(subspace *s, const quadric *q, const vector *seeds,
+        size_t, int) {
+    return depth_first_fill(s, q, seeds, 1, BIAS_EXTERIOR);
+}
+
+static int bfs_fill(subspace *s, const quadric *q, const vector *seeds,
+        size_t, int) {
+    return breadth_first_fill(s, q, seeds, 1, BIAS_EXTERIOR);
+}
+
+static int par_surface(subspace *s, const quadric *q, const vector *seeds,
+        size_t num_seeds, int num_threads) {
+    return parallel_surface(s, q, seeds, num_seeds, 1, BIAS_EXTERIOR,
+            num_threads);
+}
+
+static int par_fill(subspace *s, const quadric *q, const vector *seeds,
+        size_t num_seeds, int num_threads) {
+    return parallel_fill(s, q, seeds, num_seeds, 1, BIAS_EXTERIOR,
+            num_threads);
+}
+
+static int scan_surface(subspace *s, const quadric *q, const vector *,
+        size_t, int num_threads) {
+    return scanline_surface(s, q, 1, num_threads);
+}
+
+static int scan_fill(subspace *s, const quadric *q, const vector *,
+        size_t, int num_threads) {
+    return scanline_fill(s, q, 1, 0, num_threads);
+}
+
+static int oct_surface(subspace *s, const quadric *q, const vector *,
+        size_t, int num_threads) {
+    return octree_surface(s, q, 1, num_threads);
+}
+
+static int oct_fill(subspace *s, const quadric *q, const vector *,
+        size_t, int num_threads) {
+    return octree_fill(s, q, 1, 0, num_threads);
+}
+
+static const bench_quadric quadrics[] = {
+    {"sphere", sphere},
+    {"cone", cone},
+    {"hyperboloid", hyperboloid},
+    {"paraboloid", paraboloid}
+};
+
+static const engine engines[] = {
+    {"depth_first_surface", 0, dfs_surface},
+    {"breadth_first_surface", 0, bfs_surface},
+    {"parallel_surface", 1, par_surface},
+    {"scanline_surface", 1, scan_surface},
+    {"octree_surface", 1, oct_surface},
+    {"depth_first_fill", 0, dfs_fill},
+    {"breadth_first_fill", 0, bfs_fill},
+    {"parallel_fill", 1, par_fill},
+    {"scanline_fill", 1, scan_fill},
+    {"octree_fill", 1, oct_fill}
+};
+
+#define NUM_QUADRICS (sizeof(quadrics) / sizeof(quadrics[0]))
+#define NUM_ENGINES (sizeof(engines) / sizeof(engines[0]))
+
+static int64_t elapsed_ns(const struct timespec *start,
+        const struct timespec *end) {
+    return 1000000000 * (int64_t)(end->tv_sec - start->tv_sec) +
+        (int64_t)end->tv_nsec - (int64_t)start->tv_nsec;
+}
+
+static int compare_times(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile of the n sorted times */
+static int64_t percentile(const int64_t *times, int n, int p) {
+    int rank = (p * n + 99) / 100;
+    return times[rank < 1 ? 0 : rank - 1];
+}
+
+/* Runs one case. Returns 0 if a subspace could not be allocated or the
+ * engine failed */
+static int run_case(const bench_options *o, const engine *e,
+        const bench_quadric *bq, int64_t r, int num_threads, int64_t *times,
+        uint64_t *points, uint64_t *voxels) {
+    quadric q = bq->make(r);
+    vector seeds[MAX_SEEDS];
+    int i, ok = 1;
+    for (i = 0; ok && i < o->warmups + o->trials; i++) {
+        subspace *s = subspace_init(-r - 1, -r - 1, -r - 1, r + 2, r + 2,
+                r + 2);
+        if (!s)
+            return 0;
+        size_t num_seeds = quadric_seeds(&q, s, seeds, MAX_SEEDS,
+                BIAS_EXTERIOR);
+        if (!num_seeds) {
+            /* fills start from inside, which need not be a surface point */
+            seeds[0].x = seeds[0].y = seeds[0].z = 0;
+            num_seeds = 1;
+        }
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ok = e->run(s, &q, seeds, num_seeds, num_threads);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (i >= o->warmups)
+            times[i - o->warmups] = elapsed_ns(&start, &end);
+        *points = s->points_plotted;
+        *voxels = volume(s);
+        subspace_free(s);
+    }
+    qsort(times, o->trials, sizeof(int64_t), compare_times);
+    return ok;
+}
+
+static void report(const bench_options *o, const engine *e,
+        const bench_quadric *bq, int64_t r, int num_threads,
+        const int64_t *times, uint64_t points, uint64_t voxels) {
+    int64_t p50 = percentile(times, o->trials, 50);
+    double seconds = p50 / 1e9;
+    /* voxels of the subspace decided, and points plotted, per second */
+    double voxel_rate = voxels / seconds;
+    double point_rate = points / seconds;
+    if (o->format == FORMAT_JSON)
+        printf("{\"engine\": \"%s\", \"quadric\": \"%s\", \"radius\": %ld, "
+                "\"threads\": %d, \"trials\": %d, \"points\": %lu, "
+                "\"voxels\": %lu, \"min_ns\": %ld, \"p50_ns\": %ld, "
+                "\"p90_ns\": %ld, \"p99_ns\": %ld, \"max_ns\": %ld, "
+                "\"voxels_per_s\": %.0f, \"points_per_s\": %.0f}\n",
+                e->name, bq->name, r, num_threads, o->trials, points,
+                voxels, times[0], p50, percentile(times, o->trials, 90),
+                percentile(times, o->trials, 99), times[o->trials - 1],
+                voxel_rate, point_rate);
+    else
+        printf("%s,%s,%ld,%d,%d,%lu,%lu,%ld,%ld,%ld,%ld,%ld,%.0f,%.0f\n",
+                e->name, bq->name, r, num_threads, o->trials, points,
+                voxels, times[0], p50, percentile(times, o->trials, 90),
+                percentile(times, o->trials, 99), times[o->trials - 1],
+                voxel_rate, point_rate);
+    fflush(stdout);
+}
+
+/* Thread counts of the sweep: 1, 2, 4, ... and max_threads itself, even
+ * if it is not a power of two */
+static int next_threads(int threads, int max_threads) {
+    if (threads < max_threads && 2 * threads > max_threads)
+        return max_threads;
+    return 2 * threads;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-w warmups] [-t trials] [-j max_threads] "
+            "[-r radius]... [-e engine] [-q quadric] [-f csv|json]\n", name);
+}
+
+int main(int argc, char **argv) {
+    bench_options o;
+    memset(&o, 0, sizeof(o));
+    o.warmups = 2;
+    o.trials = 10;
+    o.max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    o.format = FORMAT_CSV;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:t:j:r:e:q:f:")) != -1) {
+        switch (opt) {
+        case 'w':
+            o.warmups = atoi(optarg);
+            break;
+        case 't':
+            o.trials = atoi(optarg);
+            break;
+        case 'j':
+            o.max_threads = atoi(optarg);
+            break;
+        case 'r':
+            if (o.num_radii < MAX_RADII)
+                o.radii[o.num_radii++] = atol(optarg);
+            break;
+        case 'e':
+            o.engine = optarg;
+            break;
+        case 'q':
+            o.quadric = optarg;
+            break;
+        case 'f':
+            o.format = strcmp(optarg, "json") ? FORMAT_CSV : FORMAT_JSON;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (o.warmups < 0 || o.trials < 1 || o.max_threads < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!o.num_radii) {
+        o.radii[o.num_radii++] = 32;
+        o.radii[o.num_radii++] = 64;
+        o.radii[o.num_radii++] = 128;
+    }
+
+    int64_t *times = (int64_t *)malloc(o.trials * sizeof(int64_t));
+    if (!times)
+        return 1;
+    if (o.format == FORMAT_CSV)
+        printf("engine,quadric,radius,threads,trials,points,voxels,min_ns,"
+                "p50_ns,p90_ns,p99_ns,max_ns,voxels_per_s,points_per_s\n");
+    size_t e, k;
+    int i, threads, failed = 0;
+    for (e = 0; e < NUM_ENGINES; e++) {
+        if (o.engine && !strstr(engines[e].name, o.engine))
+            continue;
+        for (k = 0; k < NUM_QUADRICS; k++) {
+            if (o.quadric && !strstr(quadrics[k].name, o.quadric))
+                continue;
+            for (i = 0; i < o.num_radii; i++) {
+                for (threads = 1; threads <= o.max_threads;
+                        threads = next_threads(threads, o.max_threads)) {
+                    uint64_t points = 0, voxels = 0;
+                    if (!run_case(&o, &engines[e], &quadrics[k], o.radii[i],
+                                threads, times, &points, &voxels)) {
+                        fprintf(stderr, "%s on %s, radius %ld, failed\n",
+                                engines[e].name, quadrics[k].name,
+                                o.radii[i]);
+                        failed = 1;
+                        break;
+                    }
+                    report(&o, &engines[e], &quadrics[k], o.radii[i],
+                            threads, times, points, voxels);
+                    if (!engines[e].threaded)
+                        break;
+                }
+            }
+        }
+    }
+    free(times);
+    return failed;
+}
@@ -0,0 +1,336 @@
+#include "quadric.h"
+#include <math.h>
+#include <float.h>
+
+/* Bounding boxes and seeds of quadrics. With M the symmetric matrix of the
+ * quadratic terms and l the linear ones, F(v) = v'Mv + l'v + j. Writing M
+ * as the sum of w_k u_k u_k' over its eigenvalues w_k and orthonormal
+ * eigenvectors u_k, and c for the center -M^+ l / 2 (M^+ the pseudo
+ * inverse, so c is the center closest to the origin when M is singular),
+ *
+ *     F(v) = sum w_k (u_k'(v - c))^2 + F(c)
+ *
+ * as long as l has no part along the eigenvectors with w_k = 0. If no
+ * eigenvalue is negative, F <= 0 is then an ellipsoid stretched to infinity
+ * along those eigenvectors, whose extent along axis k is
+ *
+ *     c_k +- sqrt(-F(c) sum over w_i > 0 of u_ik^2 / w_i)
+ *
+ * and is bounded as long as no eigenvector with w_i = 0 leans along the
+ * axis: ellipsoids in every axis, cylinders and pairs of planes across
+ * axes they are aligned with. */
+
+/* Slack on top of the half step is_surface looks around a point, for the
+ * rounding in the computation */
+#define BOUNDS_SLACK 1e-9
+/* Eigenvalues this small relative to the largest are taken as 0 */
+#define EIGEN_EPSILON 1e-12
+#define JACOBI_SWEEPS 32
+/* Lines per side of the lattice of lines along each axis that seeds are
+ * also looked for on */
+#define SEED_LINES 8
+
+/* The eigen decomposition of the quadratic part of a quadric */
+typedef struct _quadric_frame {
+    double m[3][3], l[3], j;
+    /* Eigenvalues, and eigenvectors in the columns of u */
+    double w[3], u[3][3];
+    /* Nonzero for the eigenvalues taken as 0 */
+    int null[3];
+    double center[3];
+} quadric_frame;
+
+static void quadric_matrix(const quadric *q, double m[3][3], double l[3]) {
+    m[0][0] = q->a;
+    m[1][1] = q->b;
+    m[2][2] = q->c;
+    m[1][2] = m[2][1] = q->d / 2;
+    m[0][2] = m[2][0] = q->e / 2;
+    m[0][1] = m[1][0] = q->f / 2;
+    l[0] = q->g;
+    l[1] = q->h;
+    l[2] = q->i;
+}
+
+/* F at a point p */
+static double quadric_value(const quadric_frame *fr, const double p[3]) {
+    double value = fr->j;
+    int a, b;
+    for (a = 0; a < 3; a++) {
+        value += fr->l[a] * p[a];
+        for (b = 0; b < 3; b++)
+            value += fr->m[a][b] * p[a] * p[b];
+    }
+    return value;
+}
+
+/* Eigenvalues and eigenvectors of the symmetric m by cyclic Jacobi
+ * rotations, each zeroing an off diagonal element */
+static void symmetric_eigen(const double m[3][3], double w[3],
+        double u[3][3]) {
+    double a[3][3];
+    int p, q, k, sweep;
+    for (p = 0; p < 3; p++)
+        for (q = 0; q < 3; q++) {
+            a[p][q] = m[p][q];
+            u[p][q] = p == q;
+        }
+    for (sweep = 0; sweep < JACOBI_SWEEPS; sweep++) {
+        double off = fabs(a[0][1]) + fabs(a[0][2]) + fabs(a[1][2]);
+        double diag = fabs(a[0][0]) + fabs(a[1][1]) + fabs(a[2][2]);
+        if (off <= DBL_EPSILON * DBL_EPSILON * diag || off == 0)
+            break;
+        for (p = 0; p < 2; p++)
+            for (q = p + 1; q < 3; q++) {
+                if (a[p][q] == 0)
+                    continue;
+                double theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+                double t = copysign(1.0, theta) /
+                    (fabs(theta) + sqrt(theta * theta + 1));
+                double c = 1 / sqrt(t * t + 1), s = t * c;
+                /* a = J'aJ with J the rotation in the p, q plane */
+                for (k = 0; k < 3; k++) {
+                    double kp = a[k][p], kq = a[k][q];
+                    a[k][p] = c * kp - s * kq;
+                    a[k][q] = s * kp + c * kq;
+                }
+                for (k = 0; k < 3; k++) {
+                    double pk = a[p][k], qk = a[q][k];
+                    a[p][k] = c * pk - s * qk;
+                    a[q][k] = s * pk + c * qk;
+                }
+                for (k = 0; k < 3; k++) {
+                    double kp = u[k][p], kq = u[k][q];
+                    u[k][p] = c * kp - s * kq;
+                    u[k][q] = s * kp + c * kq;
+                }
+            }
+    }
+    for (k = 0; k < 3; k++)
+        w[k] = a[k][k];
+}
+
+/* Fills in the frame of q, negated if negate is set, which leaves F = 0
+ * where it was */
+static void quadric_frame_init(quadric_frame *fr, const quadric *q,
+        int negate) {
+    int a, b, k;
+    quadric_matrix(q, fr->m, fr->l);
+    fr->j = q->j;
+    if (negate) {
+        for (a = 0; a < 3; a++) {
+            fr->l[a] = -fr->l[a];
+            for (b = 0; b < 3; b++)
+                fr->m[a][b] = -fr->m[a][b];
+        }
+        fr->j = -fr->j;
+    }
+    symmetric_eigen(fr->m, fr->w, fr->u);
+    double largest = fmax(fabs(fr->w[0]), fmax(fabs(fr->w[1]),
+                fabs(fr->w[2])));
+    for (a = 0; a < 3; a++)
+        fr->center[a] = 0;
+    for (k = 0; k < 3; k++) {
+        fr->null[k] = fabs(fr->w[k]) <= EIGEN_EPSILON * largest;
+        if (fr->null[k])
+            continue;
+        double along = 0;
+        for (a = 0; a < 3; a++)
+            along += fr->u[a][k] * fr->l[a];
+        for (a = 0; a < 3; a++)
+            fr->center[a] -= along / (2 * fr->w[k]) * fr->u[a][k];
+    }
+}
+
+/* Clips lo and hi to the box of F <= 0 along the axes it is bounded in.
+ * Returns -1 if the frame has a negative eigenvalue or a linear part along
+ * a null eigenvector, which leaves every axis unbounded, otherwise 0 if
+ * F <= 0 is empty and 1 if not */
+static int frame_box(const quadric_frame *fr, int64_t *lo, int64_t *hi) {
+    double scale = fabs(fr->j), length = 0;
+    int a, k;
+    for (a = 0; a < 3; a++)
+        length += fr->l[a] * fr->l[a];
+    length = sqrt(length);
+    for (k = 0; k < 3; k++) {
+        if (fr->null[k]) {
+            double along = 0;
+            for (a = 0; a < 3; a++)
+                along += fr->u[a][k] * fr->l[a];
+            if (fabs(along) > EIGEN_EPSILON * (length + 1))
+                return -1;
+        } else if (fr->w[k] < 0) {
+            return -1;
+        }
+    }
+    double depth = -quadric_value(fr, fr->center);
+    for (a = 0; a < 3; a++)
+        scale += fabs(fr->l[a] * fr->center[a]);
+    if (depth < -BOUNDS_SLACK * scale)
+        return 0;
+    for (a = 0; a < 3; a++) {
+        double spread = 0, leaning = 0;
+        for (k = 0; k < 3; k++) {
+            if (fr->null[k])
+                leaning += fr->u[a][k] * fr->u[a][k];
+            else
+                spread += fr->u[a][k] * fr->u[a][k] / fr->w[k];
+        }
+        if (leaning > EIGEN_EPSILON)
+            continue;
+        double c = fr->center[a], half = sqrt(fmax(depth, 0) * spread);
+        double slack = 1 + BOUNDS_SLACK * (fabs(c) + half + 1);
+        double from = floor(c - half - slack), to = ceil(c + half + slack) + 1;
+        if (from > lo[a])
+            lo[a] = from > hi[a] ? hi[a] : (int64_t)from;
+        if (to < hi[a])
+            hi[a] = to < lo[a] ? lo[a] : (int64_t)to;
+    }
+    return 1;
+}
+
+/* Box holding every point of s that a surface, or if surface is 0 a fill,
+ * of q can plot: box[0..2] are the lower bounds, box[3..5] the exclusive
+ * upper bounds, as in subspace. The box is s itself along the axes F <= 0
+ * is unbounded in. Returns 0 if the box is empty */
+int quadric_bounds(const quadric *q, const subspace *s, int surface,
+        int64_t *box) {
+    int64_t lo[3] = {s->x_min, s->y_min, s->z_min};
+    int64_t hi[3] = {s->x_max, s->y_max, s->z_max};
+    quadric_frame fr;
+    int k, found;
+    quadric_frame_init(&fr, q, 0);
+    found = frame_box(&fr, lo, hi);
+    if (found < 0 && surface) {
+        /* F = 0 is just as bounded when -F <= 0 is */
+        quadric_frame_init(&fr, q, 1);
+        found = frame_box(&fr, lo, hi);
+    }
+    for (k = 0; k < 3; k++) {
+        box[k] = lo[k];
+        box[k + 3] = hi[k];
+    }
+    return found && lo[0] < hi[0] && lo[1] < hi[1] && lo[2] < hi[2];
+}
+
+/* Appends a surface point of s next to p under bias, if there is one that
+ * is not already in seeds. Returns how many seeds there are now */
+static size_t add_seed(const quadric *q, const subspace *s, const double p[3],
+        vector *seeds, size_t num_seeds, size_t max_seeds, int bias) {
+    if (num_seeds >= max_seeds || !(p[0] == p[0] && p[1] == p[1] &&
+                p[2] == p[2]))
+        return num_seeds;
+    /* F = 0 at p, so the lattice point nearest to it, or failing that one
+     * of its neighbors, has probes on both sides of the surface */
+    double rx = floor(p[0] + 0.5), ry = floor(p[1] + 0.5);
+    double rz = floor(p[2] + 0.5);
+    int n, dx, dy, dz;
+    size_t i;
+    for (n = 0; n < 27; n++) {
+        dx = (n + 1) % 3 - 1;
+        dy = (n / 3 + 1) % 3 - 1;
+        dz = (n / 9 + 1) % 3 - 1;
+        vector v = {rx + dx, ry + dy, rz + dz};
+        if (!(v.x >= s->x_min && v.x < s->x_max && v.y >= s->y_min &&
+                    v.y < s->y_max && v.z >= s->z_min && v.z < s->z_max) ||
+                !is_surface(q, &v, bias))
+            continue;
+        for (i = 0; i < num_seeds; i++)
+            if (seeds[i].x == v.x && seeds[i].y == v.y && seeds[i].z == v.z)
+                return num_seeds;
+        seeds[num_seeds] = v;
+        return num_seeds + 1;
+    }
+    return num_seeds;
+}
+
+/* Adds seeds where the line through p along d crosses the surface. Along
+ * the line F(p + t d) = A t^2 + B t + C, with A = d'Md, B = d'(2Mp + l)
+ * and C = F(p) */
+static size_t line_seeds(const quadric *q, const quadric_frame *fr,
+        const subspace *s, const double p[3], const double d[3],
+        vector *seeds, size_t num_seeds, size_t max_seeds, int bias) {
+    double A = 0, B = 0, C = quadric_value(fr, p), roots[2], r[3];
+    int a, b, k, n = 0;
+    for (a = 0; a < 3; a++) {
+        double gradient = fr->l[a];
+        for (b = 0; b < 3; b++) {
+            A += d[a] * fr->m[a][b] * d[b];
+            gradient += 2 * fr->m[a][b] * p[b];
+        }
+        B += d[a] * gradient;
+    }
+    double scale = fabs(A) + fabs(B) + fabs(C);
+    if (fabs(A) <= EIGEN_EPSILON * scale) {
+        if (fabs(B) > EIGEN_EPSILON * scale)
+            roots[n++] = -C / B;
+        else if (fabs(C) <= EIGEN_EPSILON * scale || scale == 0)
+            /* the line lies on the surface */
+            roots[n++] = 0;
+    } else {
+        double disc = B * B - 4 * A * C;
+        if (disc < 0 && disc >= -EIGEN_EPSILON * B * B)
+            disc = 0;
+        if (disc >= 0) {
+            double half = -0.5 * (B + copysign(sqrt(disc), B));
+            roots[n++] = half / A;
+            if (half != 0)
+                roots[n++] = C / half;
+        }
+    }
+    for (k = 0; k < n; k++) {
+        for (a = 0; a < 3; a++)
+            r[a] = p[a] + roots[k] * d[a];
+        num_seeds = add_seed(q, s, r, seeds, num_seeds, max_seeds, bias);
+    }
+    return num_seeds;
+}
+
+/* Finds surface points of q inside s to start traversals from, writing up
+ * to max_seeds distinct ones to seeds. They are surface points according
+ * to is_surface with bias, which should be the bias of the traversals
+ * started from them. Returns how many were found.
+ *
+ * The first seeds lie where the principal axes through the center cross
+ * the surface: every sheet of a quadric crosses one of them, the apex of a
+ * cone and the vertex of a paraboloid lying on them, so each sheet that
+ * crosses them inside s gets one. Sheets that s clips away from the axes
+ * are looked for on a lattice of SEED_LINES^2 lines along each axis, which
+ * also spreads the seeds over s. No walk is involved, so none of it can
+ * stall; if it returns 0, no lattice line comes near the surface. */
+size_t quadric_seeds(const quadric *q, const subspace *s, vector *seeds,
+        size_t max_seeds, int bias) {
+    quadric_frame fr;
+    size_t num_seeds = 0;
+    double p[3], d[3];
+    int a, k, i, j;
+    stat_start(start);
+    quadric_frame_init(&fr, q, 0);
+    for (k = 0; k < 3; k++) {
+        for (a = 0; a < 3; a++)
+            d[a] = fr.u[a][k];
+        num_seeds = line_seeds(q, &fr, s, fr.center, d, seeds, num_seeds,
+                max_seeds, bias);
+    }
+    int64_t lo[3] = {s->x_min, s->y_min, s->z_min};
+    int64_t hi[3] = {s->x_max, s->y_max, s->z_max};
+    for (k = 0; k < 3; k++) {
+        int first = (k + 1) % 3, second = (k + 2) % 3;
+        for (a = 0; a < 3; a++)
+            d[a] = a == k;
+        p[k] = 0;
+        for (i = 0; i < SEED_LINES; i++) {
+            p[first] = floor(lo[first] + (hi[first] - lo[first]) *
+                    (i + 0.5) / SEED_LINES);
+            for (j = 0; j < SEED_LINES; j++) {
+                p[second] = floor(lo[second] + (hi[second] -
+                            lo[second]) * (j + 0.5) / SEED_LINES);
+                num_seeds = line_seeds(q, &fr, s, p, d, seeds, num_seeds,
+                        max_seeds, bias);
+            }
+        }
+    }
+    stat_stop(search_ns, start);
+    stat_flush();
+    return num_seeds;
+}
@@ -0,0 +1,262 @@
+#include "quadric.h"
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <immintrin.h>
+
+/* Batch classification of the points (x, y, z), ..., (x, y, z + n - 1).
+ *
+ * For fixed x and y, F is a quadratic in z, and so is F at each of the
+ * half step neighbours is_surface probes. A row therefore reduces to five
+ * quadratics c t^2 + b t + k, for the probes at x, x +- 1/2 and y +- 1/2,
+ * with the z probes taken from the first one at t +- 1/2. The kernels
+ * evaluate those for a whole vector of z values at once.
+ *
+ * The kernels do not evaluate F in the same order as eval, so where a
+ * value could round to the other side of 0 the point is classified with
+ * is_surface instead. For quadric_is_exact quadrics every value is exact
+ * and no point needs the fallback. */
+
+#define ROW_ERROR (32 * DBL_EPSILON)
+
+typedef void (*row_kernel)(const quadric *, const row *, int64_t, int64_t,
+        int64_t, size_t, uint64_t *, uint64_t *);
+
+void row_init(row *r, const quadric *q, int64_t x, int64_t y, int64_t z,
+        size_t n) {
+    double px[ROW_PROBES] = {(double)x, x + 0.5, x - 0.5, (double)x, 
+        (double)x};
+    double py[ROW_PROBES] = {(double)y, (double)y, (double)y, y + 0.5, 
+        y - 0.5};
+    int i;
+    r->c = q->c;
+    for (i = 0; i < ROW_PROBES; i++) {
+        r->b[i] = q->d * py[i] + q->e * px[i] + q->i;
+        r->k[i] = q->a * px[i] * px[i] + q->b * py[i] * py[i] +
+            q->f * px[i] * py[i] + q->g * px[i] + q->h * py[i] + q->j;
+    }
+    double X = fabs((double)x) + 0.5, Y = fabs((double)y) + 0.5;
+    double Z = fmax(fabs((double)z), fabs((double)(z + (int64_t)n))) + 0.5;
+    double magnitude = fabs(q->a) * X * X + fabs(q->b) * Y * Y +
+        fabs(q->c) * Z * Z + fabs(q->d) * Y * Z + fabs(q->e) * X * Z +
+        fabs(q->f) * X * Y + fabs(q->g) * X + fabs(q->h) * Y +
+        fabs(q->i) * Z + fabs(q->j);
+    r->tol = quadric_is_exact(q) && magnitude < EXACT_MAGNITUDE ? 0 :
+        ROW_ERROR * magnitude;
+}
+
+static void fallback(const quadric *q, int64_t x, int64_t y, int64_t z,
+        size_t i, uint64_t *surface, uint64_t *interior) {
+    vector v = {(double)x, (double)y, (double)(z + (int64_t)i)};
+    uint64_t bit = point_bit(i);
+    surface[i / 64] &= ~bit;
+    interior[i / 64] &= ~bit;
+    if (is_surface(q, &v, BIAS_EXTERIOR))
+        surface[i / 64] |= bit;
+    if (!(eval(q, &v, BIAS_EXTERIOR) > 0))
+        interior[i / 64] |= bit;
+}
+
+static void classify_scalar(const quadric *q, const row *r, int64_t x,
+        int64_t y, int64_t z, size_t n, uint64_t *surface,
+        uint64_t *interior) {
+    size_t i;
+    int k, uncertain, result;
+    double v[2 * ROW_PROBES - 3];
+    for (i = 0; i < n; i++) {
+        double t = (double)(z + (int64_t)i);
+        for (k = 0; k < ROW_PROBES; k++)
+            v[k] = (r->c * t + r->b[k]) * t + r->k[k];
+        v[5] = (r->c * (t + 0.5) + r->b[0]) * (t + 0.5) + r->k[0];
+        v[6] = (r->c * (t - 0.5) + r->b[0]) * (t - 0.5) + r->k[0];
+        uncertain = 0;
+        if (r->tol)
+            for (k = 0; k < 7; k++)
+                uncertain |= fabs(v[k]) <= r->tol;
+        if (uncertain) {
+            fallback(q, x, y, z, i, surface, interior);
+            continue;
+        }
+        /* same decisions, in the same order, as is_surface */
+        result = v[0] == 0.0;
+        for (k = 1; !result && k < 7; k += 2) {
+            if (v[k] == 0.0 || v[k + 1] == 0.0)
+                break;
+            result = (v[k] > 0.0) != (v[k + 1] > 0.0);
+        }
+        if (result)
+            surface[i / 64] |= point_bit(i);
+        if (!(v[0] > 0.0))
+            interior[i / 64] |= point_bit(i);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void classify_avx2(const quadric *q, const row *r, int64_t x,
+        int64_t y, int64_t z, size_t n, uint64_t *surface,
+        uint64_t *interior) {
+    const __m256d lane = _mm256_set_pd(3, 2, 1, 0);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    const __m256d c = _mm256_set1_pd(r->c);
+    const __m256d tol = _mm256_set1_pd(r->tol);
+    __m256d b[ROW_PROBES], k[ROW_PROBES], v[2 * ROW_PROBES - 3];
+    int p;
+    for (p = 0; p < ROW_PROBES; p++) {
+        b[p] = _mm256_set1_pd(r->b[p]);
+        k[p] = _mm256_set1_pd(r->k[p]);
+    }
+    size_t i;
+    for (i = 0; i < n; i += 4) {
+        __m256d t = _mm256_add_pd(_mm256_set1_pd((double)(z + (int64_t)i)),
+                lane);
+        for (p = 0; p < ROW_PROBES; p++)
+            v[p] = _mm256_fmadd_pd(_mm256_fmadd_pd(c, t, b[p]), t, k[p]);
+        __m256d up = _mm256_add_pd(t, half), down = _mm256_sub_pd(t, half);
+        v[5] = _mm256_fmadd_pd(_mm256_fmadd_pd(c, up, b[0]), up, k[0]);
+        v[6] = _mm256_fmadd_pd(_mm256_fmadd_pd(c, down, b[0]), down, k[0]);
+
+        int result = _mm256_movemask_pd(_mm256_cmp_pd(v[0], zero, _CMP_EQ_OQ));
+        int decided = result;
+        for (p = 1; p < 7; p += 2) {
+            decided |= _mm256_movemask_pd(
+                    _mm256_cmp_pd(v[p], zero, _CMP_EQ_OQ));
+            decided |= _mm256_movemask_pd(
+                    _mm256_cmp_pd(v[p + 1], zero, _CMP_EQ_OQ));
+            int differ = _mm256_movemask_pd(_mm256_xor_pd(
+                    _mm256_cmp_pd(v[p], zero, _CMP_GT_OQ),
+                    _mm256_cmp_pd(v[p + 1], zero, _CMP_GT_OQ)));
+            result |= differ & ~decided;
+            decided |= differ;
+        }
+        int inside = ~_mm256_movemask_pd(_mm256_cmp_pd(v[0], zero,
+                    _CMP_GT_OQ)) & 0xf;
+        int valid = n - i >= 4 ? 0xf : (1 << (n - i)) - 1;
+        surface[i / 64] |= (uint64_t)(result & valid) << (i % 64);
+        interior[i / 64] |= (uint64_t)(inside & valid) << (i % 64);
+
+        if (!r->tol)
+            continue;
+        int uncertain = 0;
+        for (p = 0; p < 7; p++)
+            uncertain |= _mm256_movemask_pd(_mm256_cmp_pd(
+                        _mm256_andnot_pd(sign, v[p]), tol, _CMP_LE_OQ));
+        uncertain &= valid;
+        while (uncertain) {
+            p = __builtin_ctz(uncertain);
+            fallback(q, x, y, z, i + p, surface, interior);
+            uncertain &= uncertain - 1;
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static void classify_avx512(const quadric *q, const row *r, int64_t x,
+        int64_t y, int64_t z, size_t n, uint64_t *surface,
+        uint64_t *interior) {
+    const __m512d lane = _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d half = _mm512_set1_pd(0.5);
+    const __m512d c = _mm512_set1_pd(r->c);
+    const __m512d tol = _mm512_set1_pd(r->tol);
+    __m512d b[ROW_PROBES], k[ROW_PROBES], v[2 * ROW_PROBES - 3];
+    int p;
+    for (p = 0; p < ROW_PROBES; p++) {
+        b[p] = _mm512_set1_pd(r->b[p]);
+        k[p] = _mm512_set1_pd(r->k[p]);
+    }
+    size_t i;
+    for (i = 0; i < n; i += 8) {
+        __m512d t = _mm512_add_pd(_mm512_set1_pd((double)(z + (int64_t)i)),
+                lane);
+        for (p = 0; p < ROW_PROBES; p++)
+            v[p] = _mm512_fmadd_pd(_mm512_fmadd_pd(c, t, b[p]), t, k[p]);
+        __m512d up = _mm512_add_pd(t, half), down = _mm512_sub_pd(t, half);
+        v[5] = _mm512_fmadd_pd(_mm512_fmadd_pd(c, up, b[0]), up, k[0]);
+        v[6] = _mm512_fmadd_pd(_mm512_fmadd_pd(c, down, b[0]), down, k[0]);
+
+        __mmask8 result = _mm512_cmp_pd_mask(v[0], zero, _CMP_EQ_OQ);
+        __mmask8 decided = result;
+        for (p = 1; p < 7; p += 2) {
+            decided |= _mm512_cmp_pd_mask(v[p], zero, _CMP_EQ_OQ);
+            decided |= _mm512_cmp_pd_mask(v[p + 1], zero, _CMP_EQ_OQ);
+            __mmask8 differ = _mm512_cmp_pd_mask(v[p], zero, _CMP_GT_OQ) ^
+                _mm512_cmp_pd_mask(v[p + 1], zero, _CMP_GT_OQ);
+            result |= differ & ~decided;
+            decided |= differ;
+        }
+        __mmask8 inside = ~_mm512_cmp_pd_mask(v[0], zero, _CMP_GT_OQ);
+        __mmask8 valid = n - i >= 8 ? 0xff : (1 << (n - i)) - 1;
+        surface[i / 64] |= (uint64_t)(result & valid) << (i % 64);
+        interior[i / 64] |= (uint64_t)(inside & valid) << (i % 64);
+
+        if (!r->tol)
+            continue;
+        unsigned uncertain = 0;
+        for (p = 0; p < 7; p++)
+            uncertain |= _mm512_cmp_pd_mask(_mm512_abs_pd(v[p]), tol,
+                    _CMP_LE_OQ);
+        uncertain &= valid;
+        while (uncertain) {
+            p = __builtin_ctz(uncertain);
+            fallback(q, x, y, z, i + p, surface, interior);
+            uncertain &= uncertain - 1;
+        }
+    }
+}
+
+static row_kernel select_kernel() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return classify_avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return classify_avx2;
+    return classify_scalar;
+}
+
+/* Classifies the n points starting at (x, y, z) along z. Bit i of surface
+ * is set if (x, y, z + i) is a surface point according to is_surface, bit
+ * i of interior if F is not positive there. Both arrays must hold
+ * bitfield_words(n) words, which are overwritten. */
+void classify_row(const quadric *q, int64_t x, int64_t y, int64_t z,
+        size_t n, uint64_t *surface, uint64_t *interior) {
+    /* initialized once, even with several threads classifying */
+    static const row_kernel kernel = select_kernel();
+    row r;
+    row_init(&r, q, x, y, z, n);
+    memset(surface, 0, bitfield_words(n) * sizeof(uint64_t));
+    memset(interior, 0, bitfield_words(n) * sizeof(uint64_t));
+    kernel(q, &r, x, y, z, n, surface, interior);
+}
+
+/* classify_row with the given CLASSIFY_ kernel rather than the best one
+ * the CPU supports, for testing the kernels against each other. Returns 0
+ * without touching the arrays if the CPU lacks the kernel */
+int classify_row_kernel(int which, const quadric *q, int64_t x, int64_t y,
+        int64_t z, size_t n, uint64_t *surface, uint64_t *interior) {
+    row_kernel kernel;
+    __builtin_cpu_init();
+    switch (which) {
+    case CLASSIFY_AVX512:
+        if (!__builtin_cpu_supports("avx512f"))
+            return 0;
+        kernel = classify_avx512;
+        break;
+    case CLASSIFY_AVX2:
+        if (!__builtin_cpu_supports("avx2") || 
+                !__builtin_cpu_supports("fma"))
+            return 0;
+        kernel = classify_avx2;
+        break;
+    default:
+        kernel = classify_scalar;
+    }
+    row r;
+    row_init(&r, q, x, y, z, n);
+    memset(surface, 0, bitfield_words(n) * sizeof(uint64_t));
+    memset(interior, 0, bitfield_words(n) * sizeof(uint64_t));
+    kernel(q, &r, x, y, z, n, surface, interior);
+    return 1;
+}
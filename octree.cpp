@@ -0,0 +1,305 @@
+#include "quadric.h"
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+
+/* Octree culling. Over a box, F(center + t) is F(center) + g't + t'Mt with
+ * g the gradient at the center, and each term has interval bounds in the
+ * half widths of the box. If F keeps one sign over the box grown by the
+ * half step is_surface probes at, no point of the box is a surface point,
+ * and the box is either entirely in F <= 0 or entirely out of it, so it is
+ * filled or skipped without looking at its points. Boxes where F may
+ * change sign are split in 8, down to OCTREE_LEAF a side, and only those
+ * are classified point by point, so the work follows the area of the
+ * surface rather than the volume of the subspace.
+ *
+ * Updates to a new quadric cull the same way: a box where the old and the
+ * new F have the same sign throughout holds the same points for both and
+ * is left alone. The boxes the new surface straddles are classified again,
+ * but their bits are only written where the points changed. */
+
+/* Side of the boxes threads take turns at, and of the smallest boxes,
+ * which are classified row by row */
+#define OCTREE_TOP 64
+#define OCTREE_LEAF 8
+/* Rounding error allowed for, relative to the magnitude of the terms */
+#define INTERVAL_ERROR (16 * DBL_EPSILON)
+
+#define BOX_OUTSIDE 0
+#define BOX_INSIDE 1
+#define BOX_STRADDLES 2
+
+typedef struct _culler {
+    subspace *s;
+    const quadric *q;
+    /* Quadric s was rasterized for when updating, NULL otherwise */
+    const quadric *old_q;
+    int fill, exterior;
+    int positive;
+    int id, num_threads;
+    uint64_t points, removed;
+    uint64_t *surface, *interior;
+} culler;
+
+/* Where the points lo <= p < hi stand: BOX_OUTSIDE if F > 0 at all of them
+ * and their probes, BOX_INSIDE if F < 0, BOX_STRADDLES if it cannot tell */
+static int box_sign(const quadric *q, const int64_t *lo, const int64_t *hi) {
+    double c[3], h[3], m[3][3], l[3] = {q->g, q->h, q->i};
+    int a, b;
+    m[0][0] = q->a;
+    m[1][1] = q->b;
+    m[2][2] = q->c;
+    m[1][2] = m[2][1] = q->d / 2;
+    m[0][2] = m[2][0] = q->e / 2;
+    m[0][1] = m[1][0] = q->f / 2;
+    for (a = 0; a < 3; a++) {
+        c[a] = (lo[a] + hi[a] - 1) / 2.0;
+        h[a] = (hi[a] - lo[a]) / 2.0;
+    }
+    double center = q->j, low = 0, high = 0, magnitude = fabs(q->j);
+    for (a = 0; a < 3; a++) {
+        double gradient = l[a], reach = fabs(c[a]) + h[a];
+        center += l[a] * c[a];
+        magnitude += fabs(l[a]) * reach;
+        for (b = 0; b < 3; b++) {
+            double term = m[a][b] * h[a] * h[b];
+            gradient += 2 * m[a][b] * c[b];
+            center += m[a][b] * c[a] * c[b];
+            magnitude += fabs(m[a][b]) * reach * (fabs(c[b]) + h[b]);
+            /* t_a^2 has the sign of its coefficient, t_a t_b either */
+            if (a != b)
+                low -= fabs(term);
+            else if (term < 0)
+                low += term;
+            if (a != b || term > 0)
+                high += a != b ? fabs(term) : term;
+        }
+        low -= fabs(gradient) * h[a];
+        high += fabs(gradient) * h[a];
+    }
+    double error = INTERVAL_ERROR * magnitude;
+    if (center + low > error)
+        return BOX_OUTSIDE;
+    if (center + high < -error)
+        return BOX_INSIDE;
+    return BOX_STRADDLES;
+}
+
+/* Claims every point of the box */
+static void fill_box(culler *cl, const int64_t *lo, const int64_t *hi) {
+    int64_t x, y;
+    for (x = lo[0]; x < hi[0]; x++)
+        for (y = lo[1]; y < hi[1]; y++)
+            cl->points += claim_run(cl->s, x, y, lo[2], hi[2] - lo[2],
+                    cl->positive);
+}
+
+/* Releases every point of the box */
+static void clear_box(culler *cl, const int64_t *lo, const int64_t *hi) {
+    int64_t x, y;
+    for (x = lo[0]; x < hi[0]; x++)
+        for (y = lo[1]; y < hi[1]; y++)
+            cl->removed += release_run(cl->s, x, y, lo[2], hi[2] - lo[2]);
+}
+
+/* Claims the runs of points set in mask, bit k standing for (x, y, z + k) */
+static void claim_mask(culler *cl, int64_t x, int64_t y, int64_t z,
+        uint64_t mask) {
+    while (mask) {
+        int start = __builtin_ctzll(mask);
+        uint64_t rest = ~mask & (~(uint64_t)0 << start);
+        int end = rest ? __builtin_ctzll(rest) : 64;
+        cl->points += claim_run(cl->s, x, y, z + start, end - start,
+                cl->positive);
+        mask &= end == 64 ? 0 : ~(uint64_t)0 << end;
+    }
+}
+
+/* Releases the runs of points set in mask, as claim_mask claims them */
+static void release_mask(culler *cl, int64_t x, int64_t y, int64_t z,
+        uint64_t mask) {
+    while (mask) {
+        int start = __builtin_ctzll(mask);
+        uint64_t rest = ~mask & (~(uint64_t)0 << start);
+        int end = rest ? __builtin_ctzll(rest) : 64;
+        cl->removed += release_run(cl->s, x, y, z + start, end - start);
+        mask &= end == 64 ? 0 : ~(uint64_t)0 << end;
+    }
+}
+
+/* Classifies the box row by row and claims the accepted runs. When
+ * updating, only the points whose state changed are touched: the visited
+ * ones that are no longer accepted are released, and the accepted ones
+ * that were not visited are claimed */
+static void classify_box(culler *cl, const int64_t *lo, const int64_t *hi) {
+    size_t n = hi[2] - lo[2], words = bitfield_words(n), i;
+    int64_t x, y;
+    for (x = lo[0]; x < hi[0]; x++) {
+        for (y = lo[1]; y < hi[1]; y++) {
+            classify_row(cl->q, x, y, lo[2], n, cl->surface, cl->interior);
+            for (i = 0; i < words; i++) {
+                int64_t z = lo[2] + 64 * i;
+                size_t len = i == words - 1 && n % 64 ? n % 64 : 64;
+                uint64_t accepted = cl->surface[i];
+                if (cl->fill)
+                    accepted |= cl->exterior ? ~cl->interior[i] :
+                        cl->interior[i];
+                if (len < 64)
+                    accepted &= point_bit(len) - 1;
+                if (cl->old_q) {
+                    uint64_t had = visited_run(cl->s, x, y, z, len);
+                    release_mask(cl, x, y, z, had & ~accepted);
+                    accepted &= ~had;
+                }
+                claim_mask(cl, x, y, z, accepted);
+            }
+        }
+    }
+}
+
+static void cull(culler *cl, const int64_t *lo, const int64_t *hi) {
+    int sign = box_sign(cl->q, lo, hi);
+    if (sign != BOX_STRADDLES) {
+        /* no surface point, and F <= 0 either everywhere or nowhere */
+        int inside = cl->fill && (sign == BOX_INSIDE) != cl->exterior;
+        if (cl->old_q && sign == box_sign(cl->old_q, lo, hi))
+            return;
+        if (inside)
+            fill_box(cl, lo, hi);
+        else if (cl->old_q)
+            clear_box(cl, lo, hi);
+        return;
+    }
+    if (hi[0] - lo[0] <= OCTREE_LEAF && hi[1] - lo[1] <= OCTREE_LEAF &&
+            hi[2] - lo[2] <= OCTREE_LEAF) {
+        classify_box(cl, lo, hi);
+        return;
+    }
+    int64_t mid[3], child_lo[3], child_hi[3];
+    int a, octant;
+    for (a = 0; a < 3; a++)
+        mid[a] = lo[a] + (hi[a] - lo[a]) / 2;
+    for (octant = 0; octant < 8; octant++) {
+        for (a = 0; a < 3; a++) {
+            int upper = octant >> a & 1;
+            child_lo[a] = upper ? mid[a] : lo[a];
+            child_hi[a] = upper ? hi[a] : mid[a];
+        }
+        if (child_lo[0] < child_hi[0] && child_lo[1] < child_hi[1] &&
+                child_lo[2] < child_hi[2])
+            cull(cl, child_lo, child_hi);
+    }
+}
+
+static void *cull_tiles(void *args) {
+    culler *cl = (culler *)args;
+    subspace *s = cl->s;
+    int64_t lo[3], hi[3];
+    int64_t n[3] = {
+        (s->x_max - s->x_min + OCTREE_TOP - 1) / OCTREE_TOP,
+        (s->y_max - s->y_min + OCTREE_TOP - 1) / OCTREE_TOP,
+        (s->z_max - s->z_min + OCTREE_TOP - 1) / OCTREE_TOP
+    };
+    int64_t t;
+    for (t = cl->id; t < n[0] * n[1] * n[2]; t += cl->num_threads) {
+        lo[0] = s->x_min + t / (n[1] * n[2]) * OCTREE_TOP;
+        lo[1] = s->y_min + t / n[2] % n[1] * OCTREE_TOP;
+        lo[2] = s->z_min + t % n[2] * OCTREE_TOP;
+        hi[0] = lo[0] + OCTREE_TOP < s->x_max ? lo[0] + OCTREE_TOP : s->x_max;
+        hi[1] = lo[1] + OCTREE_TOP < s->y_max ? lo[1] + OCTREE_TOP : s->y_max;
+        hi[2] = lo[2] + OCTREE_TOP < s->z_max ? lo[2] + OCTREE_TOP : s->z_max;
+        cull(cl, lo, hi);
+    }
+    stat_flush();
+    return NULL;
+}
+
+/* Runs the top level boxes on num_threads threads. Boxes of a thread that
+ * cannot be started are done by the caller */
+static int octree(subspace *s, const quadric *q, const quadric *old_q,
+        int fill, int exterior, int positive, int num_threads) {
+    if (num_threads < 1)
+        num_threads = 1;
+    stat_start(start);
+    size_t words = bitfield_words(OCTREE_LEAF);
+    culler *cullers = (culler *)calloc(num_threads, sizeof(culler));
+    pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    int i, ok = cullers && threads;
+    for (i = 0; ok && i < num_threads; i++) {
+        cullers[i].s = s;
+        cullers[i].q = q;
+        cullers[i].old_q = old_q;
+        cullers[i].fill = fill;
+        cullers[i].exterior = exterior;
+        cullers[i].positive = positive;
+        cullers[i].id = i;
+        cullers[i].num_threads = num_threads;
+        cullers[i].surface = (uint64_t *)malloc(words * sizeof(uint64_t));
+        cullers[i].interior = (uint64_t *)malloc(words * sizeof(uint64_t));
+        ok = cullers[i].surface && cullers[i].interior;
+    }
+
+    int started = 1;
+    if (ok) {
+        for (i = 1; i < num_threads; i++, started++)
+            if (pthread_create(&threads[i], NULL, cull_tiles, &cullers[i]))
+                break;
+        cull_tiles(&cullers[0]);
+        for (i = started; i < num_threads; i++)
+            cull_tiles(&cullers[i]);
+        for (i = 1; i < started; i++)
+            pthread_join(threads[i], NULL);
+    }
+
+    uint64_t points = 0, removed = 0;
+    for (i = 0; cullers && i < num_threads; i++) {
+        points += cullers[i].points;
+        removed += cullers[i].removed;
+        free(cullers[i].surface);
+        free(cullers[i].interior);
+    }
+    __atomic_fetch_add(&s->points_plotted, points, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&s->points_plotted, removed, __ATOMIC_RELAXED);
+    free(cullers);
+    free(threads);
+    stat_add(traversals, 1);
+    stat_stop(traverse_ns, start);
+    stat_flush();
+    return ok && !sparse_exhausted(s);
+}
+
+/* Plots every surface point of q inside s, skipping the boxes the surface
+ * provably misses. Returns 0 if the row buffers could not be allocated or
+ * a sparse s ran out of memory */
+int octree_surface(subspace *s, const quadric *q, int positive,
+        int num_threads) {
+    return octree(s, q, NULL, 0, 0, positive, num_threads);
+}
+
+/* Plots every surface point of q inside s together with the interior
+ * (F <= 0), or the exterior (F > 0) if exterior is nonzero, filling the
+ * boxes provably inside in bulk */
+int octree_fill(subspace *s, const quadric *q, int positive, int exterior,
+        int num_threads) {
+    return octree(s, q, NULL, 1, exterior, positive, num_threads);
+}
+
+/* Turns s, holding the points octree_surface, or octree_fill if fill is
+ * nonzero, plotted for old_q, into the points they would plot for q, with
+ * the same exterior and positive. Boxes where old_q and q provably have
+ * the same sign are skipped and boxes where q keeps one sign are filled or
+ * cleared in bulk. The boxes q straddles are classified again, but only
+ * their points that changed are written, so the cost follows the area of
+ * the new surface plus the points that changed rather than the volume, and
+ * an unchanged quadric costs nothing. The scanline engines plot the same
+ * points, and so do the traversals when the points are connected. Returns
+ * 0 if the row buffers could not be allocated or a sparse s ran out of
+ * memory, in which case s is partly updated */
+int octree_update(subspace *s, const quadric *old_q, const quadric *q,
+        int fill, int exterior, int positive, int num_threads) {
+    if (!memcmp(old_q, q, sizeof(quadric)))
+        return !sparse_exhausted(s);
+    return octree(s, q, old_q, fill, exterior, positive, num_threads);
+}
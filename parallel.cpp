@@ -0,0 +1,354 @@
+#include "quadric.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+/* Work stealing traversal. Every worker owns a deque of packed points that
+ * have already been claimed and accepted. The owner pushes and pops at the
+ * tail, which keeps its walk close to depth first and cache friendly, while
+ * idle workers steal half of a victim's deque from the head, which holds
+ * the oldest and therefore most spread out part of the frontier. */
+
+#define STEAL_MAX 1024
+
+typedef struct _deque {
+    pthread_mutex_t lock;
+    uint64_t *items;
+    size_t head, count, capacity;
+} deque;
+
+typedef struct _traversal {
+    subspace *s;
+    const quadric *q;
+    stepper st;
+    int positive;
+    int fill;
+    int num_workers;
+    deque *deques;
+    /* Points pushed to any deque but not yet expanded. The traversal is
+     * finished when this drops to 0 */
+    uint64_t pending;
+    /* Set by any worker that could not push its points */
+    int failed;
+} traversal;
+
+typedef struct _worker {
+    traversal *t;
+    int id;
+    uint64_t seed;
+    uint64_t surface_points;
+} worker;
+
+static int deque_init(deque *d) {
+    pthread_mutex_init(&d->lock, NULL);
+    d->head = d->count = 0;
+    d->capacity = 1024;
+    d->items = (uint64_t *)malloc(d->capacity * sizeof(uint64_t));
+    return d->items != NULL;
+}
+
+static void deque_destroy(deque *d) {
+    pthread_mutex_destroy(&d->lock);
+    free(d->items);
+}
+
+/* Takes the lock of d, counting the times another thread held it */
+static void deque_lock(deque *d) {
+#ifdef QUADRIC_STATS
+    if (!pthread_mutex_trylock(&d->lock))
+        return;
+    stat_add(contended, 1);
+    stat_start(start);
+    pthread_mutex_lock(&d->lock);
+    stat_stop(wait_ns, start);
+#else
+    pthread_mutex_lock(&d->lock);
+#endif
+}
+
+/* Caller holds the lock */
+static int deque_reserve(deque *d, size_t n) {
+    if (d->count + n <= d->capacity)
+        return 1;
+    size_t capacity = d->capacity;
+    while (d->count + n > capacity)
+        capacity <<= 1;
+    uint64_t *items = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    if (!items)
+        return 0;
+    size_t i;
+    for (i = 0; i < d->count; i++)
+        items[i] = d->items[(d->head + i) & (d->capacity - 1)];
+    free(d->items);
+    d->items = items;
+    d->head = 0;
+    d->capacity = capacity;
+    return 1;
+}
+
+static int deque_push(deque *d, const uint64_t *points, size_t n) {
+    deque_lock(d);
+    if (!deque_reserve(d, n)) {
+        pthread_mutex_unlock(&d->lock);
+        return 0;
+    }
+    size_t i;
+    for (i = 0; i < n; i++)
+        d->items[(d->head + d->count++) & (d->capacity - 1)] = points[i];
+    pthread_mutex_unlock(&d->lock);
+    return 1;
+}
+
+static int deque_pop(deque *d, uint64_t *point) {
+    int found = 0;
+    deque_lock(d);
+    if (d->count) {
+        *point = d->items[(d->head + --d->count) & (d->capacity - 1)];
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static size_t deque_steal(deque *d, uint64_t *points) {
+    deque_lock(d);
+    size_t i, n = (d->count + 1) / 2;
+    if (n > STEAL_MAX)
+        n = STEAL_MAX;
+    for (i = 0; i < n; i++)
+        points[i] = d->items[(d->head + i) & (d->capacity - 1)];
+    d->head = (d->head + n) & (d->capacity - 1);
+    d->count -= n;
+    pthread_mutex_unlock(&d->lock);
+    return n;
+}
+
+/* Claims, classifies and plots v. Nonzero if v belongs to the traversal.
+ * Surface traversals claim before classifying like depth_first_surface,
+ * fills only claim accepted points like breadth_first_fill. v is
+ * classified from its sample p when one is known */
+static int accept(worker *w, const vector *v, const sample *p) {
+    traversal *t = w->t;
+    subspace *s = t->s;
+    if (!in_bounds(s, v->x, v->y, v->z)) {
+        stat_add(out_of_bounds, 1);
+        return 0;
+    }
+    uint64_t index = _index(s, v->x, v->y, v->z);
+    if (visited_point(s, index)) {
+        stat_add(revisits, 1);
+        return 0;
+    }
+    if (t->fill) {
+        if (p ? sample_is_exterior(&t->st, p, v) :
+                !is_surface(t->q, v, t->st.bias) &&
+                eval(t->q, v, t->st.bias) > 0) {
+            stat_add(rejected, 1);
+            return 0;
+        }
+        if (!claim_point(s, index)) {
+            stat_add(revisits, 1);
+            return 0;
+        }
+    } else {
+        if (!claim_point(s, index)) {
+            stat_add(revisits, 1);
+            return 0;
+        }
+        if (p ? !sample_is_surface(&t->st, p, v) : !is_surface(t->q, v, t->st.bias)) {
+            stat_add(rejected, 1);
+            return 0;
+        }
+    }
+    stat_add(accepted, 1);
+    plot_point(s, index, t->positive);
+    w->surface_points++;
+    return 1;
+}
+
+template <int shape>
+static void expand(worker *w, uint64_t p) {
+    traversal *t = w->t;
+    subspace *s = t->s;
+    uint64_t accepted[26];
+    size_t n = 0;
+    vector tmp;
+    sample here, next;
+    int i, j, k;
+    tmp.x = unpack_x(s, p);
+    tmp.y = unpack_y(s, p);
+    tmp.z = unpack_z(s, p);
+    shaped_stepper_eval<shape>(&t->st, &tmp, &here);
+    for (i = -1; i <= 1; i++) {
+        for (j = -1; j <= 1; j++) {
+            for (k = -1; k <= 1; k++) {
+                if (!i && !j && !k)
+                    continue;
+                tmp.x = unpack_x(s, p) + i;
+                tmp.y = unpack_y(s, p) + j;
+                tmp.z = unpack_z(s, p) + k;
+                stepper_move(&t->st, &here, i, j, k, &next);
+                if (accept(w, &tmp, &next))
+                    accepted[n++] = pack_point(s, tmp.x, tmp.y, tmp.z);
+            }
+        }
+    }
+    if (!n)
+        return;
+    __atomic_fetch_add(&t->pending, n, __ATOMIC_RELAXED);
+    if (!deque_push(&t->deques[w->id], accepted, n)) {
+        __atomic_store_n(&t->failed, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&t->pending, n, __ATOMIC_RELEASE);
+    }
+}
+
+static int steal(worker *w) {
+    traversal *t = w->t;
+    uint64_t points[STEAL_MAX];
+    int i;
+    /* xorshift, so that idle workers do not all hammer the same victim */
+    w->seed ^= w->seed << 13;
+    w->seed ^= w->seed >> 7;
+    w->seed ^= w->seed << 17;
+    for (i = 0; i < t->num_workers; i++) {
+        int victim = (w->seed + i) % t->num_workers;
+        if (victim == w->id)
+            continue;
+        size_t n = deque_steal(&t->deques[victim], points);
+        if (!n)
+            continue;
+        stat_add(steals, 1);
+        if (!deque_push(&t->deques[w->id], points, n)) {
+            __atomic_store_n(&t->failed, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_sub(&t->pending, n, __ATOMIC_RELEASE);
+            return 0;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+template <int shape>
+static void *work(void *args) {
+    worker *w = (worker *)args;
+    traversal *t = w->t;
+    uint64_t p;
+    for (;;) {
+        if (deque_pop(&t->deques[w->id], &p)) {
+            expand<shape>(w, p);
+            __atomic_fetch_sub(&t->pending, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (steal(w))
+            continue;
+        if (!__atomic_load_n(&t->pending, __ATOMIC_ACQUIRE))
+            break;
+        sched_yield();
+    }
+    stat_flush();
+    return NULL;
+}
+
+static int parallel_traverse(subspace *s, const quadric *q,
+        const vector *seeds, size_t num_seeds, int positive, int bias,
+        int fill, int num_threads) {
+    traversal t;
+    if (!packable(s))
+        return 0;
+    stat_start(start);
+    if (num_threads < 1)
+        num_threads = 1;
+    t.s = s;
+    t.q = q;
+    stepper_init(&t.st, q, bias);
+    t.positive = positive;
+    t.fill = fill;
+    t.num_workers = num_threads;
+    t.pending = 0;
+    t.failed = 0;
+    t.deques = (deque *)malloc(num_threads * sizeof(deque));
+    worker *workers = (worker *)malloc(num_threads * sizeof(worker));
+    pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    int i, ok = t.deques && workers && threads;
+    int initialized = 0;
+    for (i = 0; ok && i < num_threads; i++, initialized++) {
+        ok = deque_init(&t.deques[i]);
+        workers[i].t = &t;
+        workers[i].id = i;
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        workers[i].surface_points = 0;
+    }
+
+    /* seeds are spread round robin so every worker starts with work */
+    size_t j;
+    for (j = 0; ok && j < num_seeds; j++) {
+        worker *w = &workers[j % num_threads];
+        if (!accept(w, &seeds[j], NULL))
+            continue;
+        uint64_t p = pack_point(s, seeds[j].x, seeds[j].y, seeds[j].z);
+        t.pending++;
+        ok = deque_push(&t.deques[w->id], &p, 1);
+    }
+
+    void *(*run)(void *);
+    switch (quadric_shape(q)) {
+    case QUADRIC_AXIS_ALIGNED:
+        run = work<QUADRIC_AXIS_ALIGNED>;
+        break;
+    case QUADRIC_CENTERED:
+        run = work<QUADRIC_CENTERED>;
+        break;
+    case QUADRIC_NO_CROSS:
+        run = work<QUADRIC_NO_CROSS>;
+        break;
+    default:
+        run = work<QUADRIC_GENERAL>;
+    }
+
+    /* If a thread cannot be created its deque is simply stolen from */
+    int started = 1;
+    if (ok) {
+        for (i = 1; i < num_threads; i++, started++)
+            if (pthread_create(&threads[i], NULL, run, &workers[i]))
+                break;
+        run(&workers[0]);
+        for (i = 1; i < started; i++)
+            pthread_join(threads[i], NULL);
+    }
+
+    uint64_t surface_points = 0;
+    for (i = 0; i < initialized; i++) {
+        surface_points += workers[i].surface_points;
+        deque_destroy(&t.deques[i]);
+    }
+    __atomic_fetch_add(&s->points_plotted, surface_points, __ATOMIC_RELAXED);
+    free(t.deques);
+    free(workers);
+    free(threads);
+    stat_add(traversals, 1);
+    stat_stop(traverse_ns, start);
+    stat_flush();
+    return ok && !__atomic_load_n(&t.failed, __ATOMIC_RELAXED) &&
+        !sparse_exhausted(s);
+}
+
+/* Traces every surface point connected to one of the seeds, using
+ * num_threads threads including the caller. Seeds that are not surface
+ * points are ignored. Returns 1 once the whole surface has been enumerated,
+ * 0 if the frontier could not be allocated, in which case s only holds part
+ * of the surface, if s is too large for pack_point or if a sparse s ran
+ * out of memory */
+int parallel_surface(subspace *s, const quadric *q, const vector *seeds,
+        size_t num_seeds, int positive, int bias, int num_threads) {
+    return parallel_traverse(s, q, seeds, num_seeds, positive, bias, 0,
+            num_threads);
+}
+
+/* Like parallel_surface, but plots the surface and interior points
+ * connected to the seeds */
+int parallel_fill(subspace *s, const quadric *q, const vector *seeds,
+        size_t num_seeds, int positive, int bias, int num_threads) {
+    return parallel_traverse(s, q, seeds, num_seeds, positive, bias, 1,
+            num_threads);
+}
@@ -0,0 +1,219 @@
+#include "quadric.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Occupancy pyramids of frozen subspaces. Level l has a bit per cube of
+ * 2^l points a side, set if any point of the cube is plotted, so level 0
+ * would be the points themselves. Level l + 1 is the OR of the 2x2x2
+ * cubes of level l, up to a top level that is a single cube covering the
+ * whole subspace. Levels 1 to levels are stored one after the other in
+ * f->pyramid, each row major, z fastest, and starting on a byte.
+ *
+ * Box queries descend from the top and only look inside the cubes that are
+ * occupied and partly covered by the box, so whole empty regions are
+ * skipped at whatever level they become empty, and a block aligned query
+ * is a single bit. */
+
+/* Levels needed for a single cube to cover f */
+int pyramid_levels(const frozen_subspace *f) {
+    int levels = 0;
+    if (volume(f) == 0)
+        return 0;
+    while (level_extent(f, levels, x) > 1 || level_extent(f, levels, y) > 1
+            || level_extent(f, levels, z) > 1)
+        levels++;
+    return levels;
+}
+
+/* Byte offset of level in the pyramid, or its size for levels + 1 */
+static size_t level_offset(const frozen_subspace *f, int level) {
+    size_t offset = 0;
+    int l;
+    for (l = 1; l < level; l++)
+        offset += (level_bits(f, l) + 7) / 8;
+    return offset;
+}
+
+#define cube_index(f, level, rx, ry, rz) \
+    (((uint64_t)(rx) * level_extent(f, level, y) + (uint64_t)(ry)) * \
+        level_extent(f, level, z) + (uint64_t)(rz))
+
+/* Size of the pyramid of f */
+size_t pyramid_bytes(const frozen_subspace *f) {
+    return level_offset(f, pyramid_levels(f) + 1);
+}
+
+/* Builds the pyramid of f into a new buffer and sets levels to its number
+ * of levels. Returns NULL if it could not be allocated */
+uint8_t *pyramid_build(const frozen_subspace *f, int *levels) {
+    size_t bytes = pyramid_bytes(f);
+    *levels = pyramid_levels(f);
+    uint8_t *pyramid = (uint8_t *)calloc(bytes ? bytes : 1, 1);
+    if (!pyramid || !*levels)
+        return pyramid;
+
+    /* level 1 from the plotted points, a byte of them at a time */
+    uint8_t *to = pyramid;
+    uint64_t i, index, cube;
+    unsigned bits;
+    for (i = 0; i < (index_space(f) + 7) / 8; i++) {
+        for (bits = f->points[i]; bits; bits &= bits - 1) {
+            index = 8 * i + __builtin_ctz(bits);
+            cube = cube_index(f, 1, (_x(f, index) - f->x_min) >> 1,
+                    (_y(f, index) - f->y_min) >> 1,
+                    (_z(f, index) - f->z_min) >> 1);
+            to[cube / 8] |= 1 << cube % 8;
+        }
+    }
+
+    /* every other level from the one below */
+    int level;
+    for (level = 2; level <= *levels; level++) {
+        const uint8_t *from = to;
+        to = pyramid + level_offset(f, level);
+        uint64_t ny = level_extent(f, level - 1, y);
+        uint64_t nz = level_extent(f, level - 1, z);
+        for (i = 0; i < (level_bits(f, level - 1) + 7) / 8; i++) {
+            for (bits = from[i]; bits; bits &= bits - 1) {
+                index = 8 * i + __builtin_ctz(bits);
+                cube = cube_index(f, level, index / nz / ny >> 1,
+                        index / nz % ny >> 1, index % nz >> 1);
+                to[cube / 8] |= 1 << cube % 8;
+            }
+        }
+    }
+    return pyramid;
+}
+
+/* Builds the pyramid of f if it does not have one. Returns 0 if it could
+ * not be allocated */
+int frozen_subspace_pyramid(frozen_subspace *f) {
+    if (f->pyramid)
+        return 1;
+    f->pyramid = pyramid_build(f, &f->levels);
+    return f->pyramid != NULL;
+}
+
+/* Bit of cube (rx, ry, rz) of level, relative to the lower bounds */
+static int cube_bit(const frozen_subspace *f, int level, int64_t rx,
+        int64_t ry, int64_t rz) {
+    if (!level)
+        return frozen_point(f, _index(f, rx + f->x_min, ry + f->y_min,
+                    rz + f->z_min));
+    uint64_t cube = cube_index(f, level, rx, ry, rz);
+    const uint8_t *bits = f->pyramid + level_offset(f, level);
+    return bits[cube / 8] >> cube % 8 & 1;
+}
+
+/* Nonzero if cube c of level has an occupied point in lo <= p < hi, all
+ * relative to the lower bounds and clipped to f */
+static int descend(const frozen_subspace *f, int level, const int64_t *c,
+        const int64_t *lo, const int64_t *hi) {
+    int64_t cube_lo[3], cube_hi[3], child[3];
+    int64_t ext[3] = {extent(f, x), extent(f, y), extent(f, z)};
+    int a, covered = 1, octant;
+    for (a = 0; a < 3; a++) {
+        cube_lo[a] = c[a] << level;
+        cube_hi[a] = (c[a] + 1) << level;
+        if (cube_hi[a] > ext[a])
+            cube_hi[a] = ext[a];
+        if (cube_lo[a] >= hi[a] || cube_hi[a] <= lo[a])
+            return 0;
+        covered &= cube_lo[a] >= lo[a] && cube_hi[a] <= hi[a];
+    }
+    if (!cube_bit(f, level, c[0], c[1], c[2]))
+        return 0;
+    if (covered || !level)
+        return 1;
+    for (octant = 0; octant < 8; octant++) {
+        for (a = 0; a < 3; a++)
+            child[a] = 2 * c[a] + (octant >> a & 1);
+        if (child[0] < level_extent(f, level - 1, x) &&
+                child[1] < level_extent(f, level - 1, y) &&
+                child[2] < level_extent(f, level - 1, z) &&
+                descend(f, level - 1, child, lo, hi))
+            return 1;
+    }
+    return 0;
+}
+
+/* Nonzero if any point lo <= p < hi of f is plotted. Without a pyramid
+ * every point of the box is looked at */
+int frozen_box(const frozen_subspace *f, const int64_t *lo,
+        const int64_t *hi) {
+    int64_t min[3] = {f->x_min, f->y_min, f->z_min};
+    int64_t max[3] = {f->x_max, f->y_max, f->z_max};
+    int64_t from[3], to[3], top[3] = {0, 0, 0};
+    int a;
+    for (a = 0; a < 3; a++) {
+        from[a] = (lo[a] > min[a] ? lo[a] : min[a]) - min[a];
+        to[a] = (hi[a] < max[a] ? hi[a] : max[a]) - min[a];
+        if (from[a] >= to[a])
+            return 0;
+    }
+    if (f->pyramid)
+        return descend(f, f->levels, top, from, to);
+    int64_t x, y, z;
+    for (x = from[0]; x < to[0]; x++)
+        for (y = from[1]; y < to[1]; y++)
+            for (z = from[2]; z < to[2]; z++)
+                if (frozen_point(f, _index(f, x + f->x_min, y + f->y_min,
+                                z + f->z_min)))
+                    return 1;
+    return 0;
+}
+
+/* Nonzero if any point of the cube of level holding (x, y, z) is plotted.
+ * Level 0 is the point itself, levels above the top are the top, and
+ * points outside of f are never plotted */
+int frozen_cube(const frozen_subspace *f, int level, int64_t x, int64_t y,
+        int64_t z) {
+    if (!in_bounds(f, x, y, z))
+        return 0;
+    if (f->pyramid && level > f->levels)
+        level = f->levels;
+    if (f->pyramid || !level)
+        return cube_bit(f, level, (x - f->x_min) >> level,
+                (y - f->y_min) >> level, (z - f->z_min) >> level);
+    int64_t lo[3], hi[3], p[3] = {x - f->x_min, y - f->y_min, z - f->z_min};
+    int64_t min[3] = {f->x_min, f->y_min, f->z_min};
+    int a;
+    if (level > 62)
+        level = 62;
+    for (a = 0; a < 3; a++) {
+        lo[a] = min[a] + (p[a] >> level << level);
+        hi[a] = lo[a] + ((int64_t)1 << level);
+    }
+    return frozen_box(f, lo, hi);
+}
+
+/* Copies level of the pyramid of f, 1 <= level <= f->levels, into a new
+ * row major frozen_subspace with a point per cube, from (0, 0, 0) up to
+ * the level_extent of each axis, as a coarse preview of f. Returns NULL if
+ * f has no such level or it could not be allocated */
+frozen_subspace *frozen_subspace_level(const frozen_subspace *f,
+        int level) {
+    if (!f->pyramid || level < 1 || level > f->levels)
+        return NULL;
+    frozen_subspace *preview = (frozen_subspace *)malloc(
+            sizeof(frozen_subspace));
+    if (!preview)
+        return NULL;
+    preview->x_min = preview->y_min = preview->z_min = 0;
+    preview->x_max = level_extent(f, level, x);
+    preview->y_max = level_extent(f, level, y);
+    preview->z_max = level_extent(f, level, z);
+    preview->brick_shift = preview->table_shift = 0;
+    preview->pyramid = NULL;
+    preview->levels = 0;
+    preview->mapping = NULL;
+    preview->mapped = 0;
+    size_t bytes = (level_bits(f, level) + 7) / 8;
+    preview->points = (uint8_t *)malloc(bytes);
+    if (!preview->points) {
+        free(preview);
+        return NULL;
+    }
+    memcpy(preview->points, f->pyramid + level_offset(f, level), bytes);
+    return preview;
+}
@@ -3,13 +3,13 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stdio.h>
-#include <list>
 #include <float.h>
 #include <math.h>
 #include <assert.h>
 #include <errno.h>
 #include <error.h>
 #include <string.h>
+#include <sys/mman.h>
 //#include <boost/circular_buffer.hpp>
 
 #define EPSILON 0.50
@@ -22,43 +22,20 @@
 
 /* ax^2 + by^2 + cz^2 + 2fyz + 2gzx + 2hxy + 2px + 2qy + 2rz + d = 0. */
 
-double (*eval_funcs[])(const quadric *, const vector *) = {eval_ext, eval_int};
-double (*eval)(const quadric *, const vector *) = eval_ext;
-
 double eval_int(const quadric *q, const vector *v) {
-    double result = q->a * v->x * v->x + 
-        q->b * v->y * v->y + 
-        q->c * v->z * v->z + 
-        q->d * v->y * v->z + 
-        q->e * v->x * v->z + 
-        q->f * v->x * v->y+ 
-        q->g * v->x + 
-        q->h * v->y + 
-        q->i * v->z + 
-        q->j;
     // bias of 0 should go to negative
-    return result == 0.0 ? -result : result;
+    return eval(q, v, BIAS_INTERIOR);
 }
 
 double eval_ext(const quadric *q, const vector *v) {
-    double result = q->a * v->x * v->x + 
-        q->b * v->y * v->y + 
-        q->c * v->z * v->z + 
-        q->d * v->y * v->z + 
-        q->e * v->x * v->z + 
-        q->f * v->x * v->y+ 
-        q->g * v->x + 
-        q->h * v->y + 
-        q->i * v->z + 
-        q->j;
     // bias of 0 should go to positive
-    return result;
+    return eval(q, v, BIAS_EXTERIOR);
 }
 
 /* if eval() of all neighboring points are of all the same sign, then
  * v cannot be on the surface. Otherwise, it may be*/
-int is_surface(const quadric *q, const vector *v) {
-    double val = eval(q, v);
+int is_surface(const quadric *q, const vector *v, int bias) {
+    double val = eval(q, v, bias);
     if (val == 0.0)
         return 1;
     vector tmp;
@@ -68,14 +45,14 @@ int is_surface(const quadric *q, const vector *v) {
         tmp.x = v->x + EPSILON * (i & 0x1);
         tmp.y = v->y + EPSILON * ((i & 0x2) >> 1);
         tmp.z = v->z + EPSILON * ((i & 0x4) >> 2);
-        val = eval(q, &tmp);
+        val = eval(q, &tmp, bias);
         if (val == 0.0) 
             return 0;
         sign1 = val > 0.0;
         tmp.x = v->x - EPSILON * (i & 0x1);
         tmp.y = v->y - EPSILON * ((i & 0x2) >> 1);
         tmp.z = v->z - EPSILON * ((i & 0x4) >> 2);
-        val = eval(q, &tmp);
+        val = eval(q, &tmp, bias);
         sign2 = val > 0.0;
         if (val == 0.0)
             return 0;
@@ -85,40 +62,519 @@ int is_surface(const quadric *q, const vector *v) {
     return 0;
 }
 
+#define EXACT_COEFFICIENT (1 << 20)
+
+/* Shape of q for shape_dispatch */
+int quadric_shape(const quadric *q) {
+    int shape = QUADRIC_GENERAL;
+    if (q->d == 0 && q->e == 0 && q->f == 0)
+        shape |= QUADRIC_NO_CROSS;
+    if (q->g == 0 && q->h == 0 && q->i == 0)
+        shape |= QUADRIC_CENTERED;
+    return shape;
+}
+
+/* Nonzero if all coefficients are small integers. F is then a multiple of
+ * 1/4 at every point of the half lattice, and exact in any evaluation
+ * order as long as the magnitude of its terms stays below
+ * EXACT_MAGNITUDE */
+int quadric_is_exact(const quadric *q) {
+    const double *c = &q->a;
+    int n;
+    for (n = 0; n < 10; n++)
+        if (c[n] != floor(c[n]) || fabs(c[n]) > EXACT_COEFFICIENT)
+            return 0;
+    return 1;
+}
+
+void stepper_init(stepper *st, const quadric *q, int bias) {
+    int dx, dy, dz, n;
+    st->q = q;
+    st->bias = bias;
+    st->exact = quadric_is_exact(q);
+    for (dx = -1, n = 0; dx <= 1; dx++) {
+        for (dy = -1; dy <= 1; dy++) {
+            for (dz = -1; dz <= 1; dz++, n++) {
+                st->df[n] = q->a * dx * dx + q->b * dy * dy + 
+                    q->c * dz * dz + q->d * dy * dz + q->e * dx * dz + 
+                    q->f * dx * dy;
+                st->dgx[n] = 2 * q->a * dx + q->f * dy + q->e * dz;
+                st->dgy[n] = q->f * dx + 2 * q->b * dy + q->d * dz;
+                st->dgz[n] = q->e * dx + q->d * dy + 2 * q->c * dz;
+            }
+        }
+    }
+    st->quarter_x = q->a / 4;
+    st->quarter_y = q->b / 4;
+    st->quarter_z = q->c / 4;
+}
+
+/* Full evaluation of F and its gradient at v */
+void stepper_eval(const stepper *st, const vector *v, sample *out) {
+    shaped_stepper_eval<QUADRIC_GENERAL>(st, v, out);
+}
+
+/* Moves a sample by a unit offset (dx, dy, dz), each of -1, 0 or 1 */
+void stepper_move(const stepper *st, const sample *from, int dx, int dy,
+        int dz, sample *to) {
+    int n = (dx + 1) * 9 + (dy + 1) * 3 + dz + 1;
+    stat_add(steps, 1);
+    double f = from->f + st->df[n];
+    if (dx)
+        f += dx > 0 ? from->gx : -from->gx;
+    if (dy)
+        f += dy > 0 ? from->gy : -from->gy;
+    if (dz)
+        f += dz > 0 ? from->gz : -from->gz;
+    to->gx = from->gx + st->dgx[n];
+    to->gy = from->gy + st->dgy[n];
+    to->gz = from->gz + st->dgz[n];
+    to->f = f;
+    to->err = from->err ? from->err + STEP_ERROR * (fabs(f) + 
+            fabs(to->gx) + fabs(to->gy) + fabs(to->gz)) : 0;
+}
+
+/* is_surface for samples too close to 0 to be trusted */
+static int sample_fallback(const stepper *st, const vector *v) {
+    stat_add(fallbacks, 1);
+    return is_surface(st->q, v, st->bias);
+}
+
+/* Same classification as is_surface(q, v) for the sample p taken at v,
+ * with the half step neighbours derived from the gradient */
+int sample_is_surface(const stepper *st, const sample *p, const vector *v) {
+    if (p->err && fabs(p->f) <= p->err)
+        return sample_fallback(st, v);
+    if (p->f == 0.0)
+        return 1;
+    double g[3] = {p->gx / 2, p->gy / 2, p->gz / 2};
+    double quarter[3] = {st->quarter_x, st->quarter_y, st->quarter_z};
+    double val;
+    uint64_t sign1, sign2;
+    int i;
+    for (i = 0; i < 3; i++) {
+        val = p->f + g[i] + quarter[i];
+        if (p->err && fabs(val) <= p->err)
+            return sample_fallback(st, v);
+        if (val == 0.0)
+            return 0;
+        sign1 = val > 0.0;
+        val = p->f - g[i] + quarter[i];
+        if (p->err && fabs(val) <= p->err)
+            return sample_fallback(st, v);
+        if (val == 0.0)
+            return 0;
+        sign2 = val > 0.0;
+        if (sign1 != sign2)
+            return 1;
+    }
+    return 0;
+}
+
+/* Nonzero if v is neither a surface nor an interior point, the points
+ * fills stop at */
+int sample_is_exterior(const stepper *st, const sample *p, const vector *v) {
+    if (sample_is_surface(st, p, v))
+        return 0;
+    if (p->err && fabs(p->f) <= p->err)
+        return eval(st->q, v, st->bias) > 0;
+    return p->f > 0;
+}
+
+/* Fields at least this large are mapped straight from the kernel. Its
+ * pages read as zero and are only materialized when first written, by
+ * whichever thread touches them, so creating a subspace takes the same time
+ * whatever its volume. calloc may instead hand out recycled heap memory it
+ * has to clear first */
+#define MAP_THRESHOLD (1 << 20)
+
+static void *zeroed(size_t bytes) {
+    if (bytes < MAP_THRESHOLD)
+        return calloc(bytes, 1);
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static void release(void *p, size_t bytes) {
+    if (!p)
+        return;
+    if (bytes < MAP_THRESHOLD)
+        free(p);
+    else
+        munmap(p, bytes);
+}
+
+#define field_bytes(s) (bitfield_words(index_space(s)) * sizeof(uint64_t))
+#define directory_bytes(s) ((size_t)(blocks(s, x) * blocks(s, y) * \
+            blocks(s, z)) * sizeof(uint64_t **))
+
 subspace *subspace_init(int64_t x_min, int64_t y_min, 
         int64_t z_min, int64_t x_max, int64_t y_max, int64_t z_max) {
+    return subspace_init_layout(x_min, y_min, z_min, x_max, y_max, z_max, 0);
+}
+
+/* Like subspace_init, but stores the points in bricks of 2^brick_shift
+ * points a side, BRICK_SHIFT for cache friendly traversals, or row major
+ * if brick_shift is 0 */
+subspace *subspace_init_layout(int64_t x_min, int64_t y_min, 
+        int64_t z_min, int64_t x_max, int64_t y_max, int64_t z_max,
+        int brick_shift) {
+    stat_start(start);
     subspace *s = (subspace *)malloc(sizeof(subspace));
+    if (!s)
+        return NULL;
     s->x_min = x_min;
     s->y_min = y_min;
     s->z_min = z_min;
     s->x_max = x_max;
     s->y_max = y_max;
     s->z_max = z_max;
-    size_t space_size = (x_max - x_min) * (y_max - y_min) * (z_max - z_min);
-    sem_init(&s->points_plotted, 0, 0);
-    s->points = (point *)calloc(space_size, sizeof(point));
-    size_t i;
-    for (i = 0; i < space_size; i++) {
-        // initialize x, y, and z
-        s->points[i].x = _x(s, i);
-        s->points[i].y = _y(s, i);
-        s->points[i].z = _z(s, i);
-        if(sem_init(&s->points[i].sema, 0, 1) == -1) {
-            free(s->points);
-            free(s);
-            return NULL;
-        }
+    s->brick_shift = brick_shift;
+    s->table_shift = 0;
+    s->points_plotted = 0;
+    s->stack_limit = 0;
+    s->bricks = NULL;
+    s->bricks_allocated = 0;
+    s->exhausted = 0;
+    s->visited = (uint64_t *)zeroed(field_bytes(s));
+    s->plotted = (uint64_t *)zeroed(field_bytes(s));
+    if (!s->visited || !s->plotted) {
+        release(s->visited, field_bytes(s));
+        release(s->plotted, field_bytes(s));
+        free(s);
+        return NULL;
     }
+    stat_stop(init_ns, start);
+    stat_flush();
+    return s;
+}
+
+/* Like subspace_init, but memory is only allocated for the bricks that
+ * traversals actually touch, so a surface costs memory in proportion to
+ * its area rather than to the bounding volume */
+subspace *subspace_init_sparse(int64_t x_min, int64_t y_min, 
+        int64_t z_min, int64_t x_max, int64_t y_max, int64_t z_max) {
+    stat_start(start);
+    subspace *s = (subspace *)malloc(sizeof(subspace));
+    if (!s)
+        return NULL;
+    s->x_min = x_min;
+    s->y_min = y_min;
+    s->z_min = z_min;
+    s->x_max = x_max;
+    s->y_max = y_max;
+    s->z_max = z_max;
+    s->brick_shift = SPARSE_BRICK_SHIFT;
+    s->table_shift = SPARSE_TABLE_SHIFT;
+    s->points_plotted = 0;
+    s->stack_limit = 0;
+    s->visited = s->plotted = NULL;
+    s->bricks_allocated = 0;
+    s->exhausted = 0;
+    s->bricks = (uint64_t ***)zeroed(directory_bytes(s));
+    if (!s->bricks) {
+        free(s);
+        return NULL;
+    }
+    stat_stop(init_ns, start);
+    stat_flush();
     return s;
 }
 
 void subspace_free(subspace *s) {
-    free(s->points);
+    size_t i, j;
+    if (s->bricks) {
+        for (i = 0; i < (size_t)(blocks(s, x) * blocks(s, y) * 
+                    blocks(s, z)); i++) {
+            if (!s->bricks[i])
+                continue;
+            for (j = 0; j < table_size(s); j++)
+                free(s->bricks[i][j]);
+            free(s->bricks[i]);
+        }
+        release(s->bricks, directory_bytes(s));
+    } else {
+        release(s->visited, field_bytes(s));
+        release(s->plotted, field_bytes(s));
+    }
     free(s);
 }
 
+/* The brick of a sparse subspace holding index, NULL if it has not been
+ * allocated */
+static uint64_t *find_brick(const subspace *s, uint64_t index) {
+    uint64_t **table = __atomic_load_n(&s->bricks[_block(s, index)], 
+            __ATOMIC_ACQUIRE);
+    if (!table)
+        return NULL;
+    return __atomic_load_n(&table[index >> 3 * s->brick_shift & 
+            (table_size(s) - 1)], __ATOMIC_ACQUIRE);
+}
+
+/* Like find_brick, but allocates the brick and its table if need be.
+ * Threads race to install them, the losers free their copies */
+static uint64_t *touch_brick(subspace *s, uint64_t index) {
+    uint64_t ***slot = &s->bricks[_block(s, index)];
+    uint64_t **table = __atomic_load_n(slot, __ATOMIC_ACQUIRE), **expected;
+    if (!table) {
+        table = (uint64_t **)calloc(table_size(s), sizeof(uint64_t *));
+        if (!table) {
+            __atomic_store_n(&s->exhausted, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        expected = NULL;
+        if (!__atomic_compare_exchange_n(slot, &expected, table, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(table);
+            table = expected;
+        }
+    }
+    uint64_t **brick_slot = &table[index >> 3 * s->brick_shift & 
+        (table_size(s) - 1)];
+    uint64_t *brick = __atomic_load_n(brick_slot, __ATOMIC_ACQUIRE), *none;
+    if (!brick) {
+        brick = (uint64_t *)calloc(2 * brick_words(s), sizeof(uint64_t));
+        if (!brick) {
+            __atomic_store_n(&s->exhausted, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        none = NULL;
+        if (__atomic_compare_exchange_n(brick_slot, &none, brick, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_fetch_add(&s->bricks_allocated, 1, __ATOMIC_RELAXED);
+        } else {
+            free(brick);
+            brick = none;
+        }
+    }
+    return brick;
+}
+
+#define brick_offset(s, index) ((index) & \
+        (((uint64_t)1 << 3 * (s)->brick_shift) - 1))
+
+int sparse_claim(subspace *s, uint64_t index) {
+    uint64_t *brick = touch_brick(s, index);
+    if (!brick)
+        return 0;
+    index = brick_offset(s, index);
+    return !(__atomic_fetch_or(&brick[index / 64], point_bit(index),
+                __ATOMIC_RELAXED) & point_bit(index));
+}
+
+uint64_t sparse_plot(subspace *s, uint64_t index, int positive) {
+    uint64_t *brick = find_brick(s, index);
+    if (!brick)
+        return 0;
+    index = brick_offset(s, index);
+    uint64_t *word = &brick[brick_words(s) + index / 64];
+    return positive ? 
+        __atomic_fetch_or(word, point_bit(index), __ATOMIC_RELAXED) :
+        __atomic_fetch_and(word, ~point_bit(index), __ATOMIC_RELAXED);
+}
+
+/* Bit of index in the visited or, if plotted is nonzero, plotted field */
+int sparse_test(const subspace *s, uint64_t index, int plotted) {
+    const uint64_t *brick = find_brick(s, index);
+    if (!brick)
+        return 0;
+    index = brick_offset(s, index);
+    return (__atomic_load_n(&brick[plotted * brick_words(s) + index / 64],
+                __ATOMIC_RELAXED) >> index % 64) & 1;
+}
+
+/* claim_run for n consecutive bits of a single pair of fields */
+static uint64_t claim_bits(uint64_t *visited, uint64_t *plotted,
+        uint64_t index, uint64_t n, int positive) {
+    uint64_t claimed = 0, len, mask, fresh;
+    while (n) {
+        len = 64 - index % 64 < n ? 64 - index % 64 : n;
+        mask = (len == 64 ? ~(uint64_t)0 : point_bit(len) - 1) << index % 64;
+        fresh = mask & ~__atomic_fetch_or(&visited[index / 64], mask,
+                __ATOMIC_RELAXED);
+        if (fresh && positive)
+            __atomic_fetch_or(&plotted[index / 64], fresh,
+                    __ATOMIC_RELAXED);
+        else if (fresh)
+            __atomic_fetch_and(&plotted[index / 64], ~fresh,
+                    __ATOMIC_RELAXED);
+        claimed += __builtin_popcountll(fresh);
+        index += len;
+        n -= len;
+    }
+    return claimed;
+}
+
+/* Claims the n points from (x, y, z) on along z, plotting the ones no
+ * traversal had visited yet a word at a time. Returns how many that were */
+uint64_t claim_run(subspace *s, int64_t x, int64_t y, int64_t z, uint64_t n,
+        int positive) {
+    uint64_t claimed = 0, len, index;
+    uint64_t brick_side = (uint64_t)1 << s->brick_shift;
+    while (n) {
+        /* indices are only consecutive within a brick */
+        len = n;
+        if (s->brick_shift && brick_side - (z - s->z_min) % brick_side < len)
+            len = brick_side - (z - s->z_min) % brick_side;
+        index = _index(s, x, y, z);
+        if (!s->bricks) {
+            claimed += claim_bits(s->visited, s->plotted, index, len,
+                    positive);
+        } else {
+            uint64_t *brick = touch_brick(s, index);
+            if (brick)
+                claimed += claim_bits(brick, brick + brick_words(s),
+                        brick_offset(s, index), len, positive);
+        }
+        z += len;
+        n -= len;
+    }
+    return claimed;
+}
+
+/* Clears n consecutive bits of a single pair of fields, returning how many
+ * of them were visited */
+static uint64_t release_bits(uint64_t *visited, uint64_t *plotted,
+        uint64_t index, uint64_t n) {
+    uint64_t released = 0, len, mask;
+    while (n) {
+        len = 64 - index % 64 < n ? 64 - index % 64 : n;
+        mask = (len == 64 ? ~(uint64_t)0 : point_bit(len) - 1) << index % 64;
+        /* only visited points are plotted, so empty words are left alone */
+        if (!(mask & __atomic_load_n(&visited[index / 64],
+                        __ATOMIC_RELAXED))) {
+            index += len;
+            n -= len;
+            continue;
+        }
+        released += __builtin_popcountll(mask & __atomic_fetch_and(
+                    &visited[index / 64], ~mask, __ATOMIC_RELAXED));
+        __atomic_fetch_and(&plotted[index / 64], ~mask, __ATOMIC_RELAXED);
+        index += len;
+        n -= len;
+    }
+    return released;
+}
+
+/* Undoes claim_run: the n points from (x, y, z) on along z are neither
+ * visited nor plotted any more. Returns how many had been visited */
+uint64_t release_run(subspace *s, int64_t x, int64_t y, int64_t z,
+        uint64_t n) {
+    uint64_t released = 0, len, index;
+    uint64_t brick_side = (uint64_t)1 << s->brick_shift;
+    while (n) {
+        len = n;
+        if (s->brick_shift && brick_side - (z - s->z_min) % brick_side < len)
+            len = brick_side - (z - s->z_min) % brick_side;
+        index = _index(s, x, y, z);
+        if (!s->bricks) {
+            released += release_bits(s->visited, s->plotted, index, len);
+        } else {
+            /* bricks that were never touched hold nothing to clear */
+            uint64_t *brick = find_brick(s, index);
+            if (brick)
+                released += release_bits(brick, brick + brick_words(s),
+                        brick_offset(s, index), len);
+        }
+        z += len;
+        n -= len;
+    }
+    return released;
+}
+
+/* n consecutive bits, n at most 64, of a single field */
+static uint64_t load_bits(const uint64_t *field, uint64_t index, uint64_t n) {
+    uint64_t bits = __atomic_load_n(&field[index / 64], __ATOMIC_RELAXED) >>
+        index % 64;
+    if (index % 64 + n > 64)
+        bits |= __atomic_load_n(&field[index / 64 + 1], __ATOMIC_RELAXED) <<
+            (64 - index % 64);
+    return n == 64 ? bits : bits & (point_bit(n) - 1);
+}
+
+/* Which of the n points from (x, y, z) on along z, n at most 64, are
+ * visited: bit k for (x, y, z + k) */
+uint64_t visited_run(const subspace *s, int64_t x, int64_t y, int64_t z,
+        uint64_t n) {
+    uint64_t visited = 0, done = 0, len, index;
+    uint64_t brick_side = (uint64_t)1 << s->brick_shift;
+    while (done < n) {
+        len = n - done;
+        if (s->brick_shift && brick_side - (z - s->z_min) % brick_side < len)
+            len = brick_side - (z - s->z_min) % brick_side;
+        index = _index(s, x, y, z);
+        if (!s->bricks) {
+            visited |= load_bits(s->visited, index, len) << done;
+        } else {
+            const uint64_t *brick = find_brick(s, index);
+            if (brick)
+                visited |= load_bits(brick, brick_offset(s, index), len) <<
+                    done;
+        }
+        z += len;
+        done += len;
+    }
+    return visited;
+}
+
+/* Copies the plotted points of s into a new frozen_subspace with the same
+ * layout, or a row major one if s is sparse. Returns NULL if it could not
+ * be allocated */
+frozen_subspace *subspace_freeze(const subspace *s) {
+    frozen_subspace *f = (frozen_subspace *)malloc(sizeof(frozen_subspace));
+    if (!f)
+        return NULL;
+    f->x_min = s->x_min;
+    f->y_min = s->y_min;
+    f->z_min = s->z_min;
+    f->x_max = s->x_max;
+    f->y_max = s->y_max;
+    f->z_max = s->z_max;
+    f->brick_shift = s->bricks ? 0 : s->brick_shift;
+    f->table_shift = s->bricks ? 0 : s->table_shift;
+    f->pyramid = NULL;
+    f->levels = 0;
+    f->mapping = NULL;
+    f->mapped = 0;
+    f->points = (uint8_t *)calloc((index_space(f) + 7) / 8, sizeof(uint8_t));
+    if (!f->points) {
+        free(f);
+        return NULL;
+    }
+
+    uint64_t index, i, j, words, bit, word;
+    if (!s->bricks) {
+        for (i = 0; i < (index_space(f) + 7) / 8; i++)
+            f->points[i] = s->plotted[i / 8] >> 8 * (i % 8);
+        return f;
+    }
+    uint64_t num_bricks = index_space(s) >> 3 * s->brick_shift;
+    words = brick_words(s);
+    for (i = 0; i < num_bricks; i++) {
+        const uint64_t *brick = find_brick(s, i << 3 * s->brick_shift);
+        if (!brick)
+            continue;
+        for (j = 0; j < words; j++) {
+            for (word = brick[words + j]; word; word &= word - 1) {
+                bit = __builtin_ctzll(word);
+                index = (i << 3 * s->brick_shift) + 64 * j + bit;
+                uint64_t to = _index(f, _x(s, index), _y(s, index), 
+                        _z(s, index));
+                f->points[to / 8] |= 1 << to % 8;
+            }
+        }
+    }
+    return f;
+}
+
 void frozen_subspace_free(frozen_subspace *f) {
-    free(f->points);
+    if (f->mapping) {
+        munmap(f->mapping, f->mapped);
+    } else {
+        free(f->points);
+        free(f->pyramid);
+    }
     free(f);
 }
 
@@ -127,211 +583,549 @@ void frozen_subspace_free(frozen_subspace *f) {
  * coordinates of the surface point. If 0 is returned, the new coordinates in 
  * surface are undefined
  */
-int find_surface(quadric *q, const vector *v, vector *surface) {
-    vector tmp, closest;
+int find_surface(quadric *q, const vector *v, vector *surface, int bias) {
+    stepper st;
+    sample current, tmp, closest;
+    vector step;
     double dist, shortest_dist;
-    int i;
+    int i, sign, dx, dy, dz;
     shortest_dist = DBL_MAX;
     int progress = 1;
+    stat_start(start);
+    stepper_init(&st, q, bias);
     *surface = *v;
-    while(!is_surface(q, surface) && progress) {
+    stepper_eval(&st, surface, &current);
+    while(!sample_is_surface(&st, &current, surface) && progress) {
         progress = 0;
+        stat_add(search_steps, 1);
         for (i = 1; i <= 4; i <<=1) {
-            tmp.x = surface ->x + (i & 0x1);
-            tmp.y = surface ->y + ((i & 0x2) >> 1);
-            tmp.z = surface ->z + ((i & 0x4) >> 2);
-            if ((dist = fabs(eval(q, &tmp))) < shortest_dist) {
-                shortest_dist = dist;
-                closest = tmp;
-                progress = 1;
-            }
-            tmp.x = surface->x - (i & 0x1);
-            tmp.y = surface->y - ((i & 0x2) >> 1);
-            tmp.z = surface->z - ((i & 0x4) >> 2);
-            if ((dist = fabs(eval(q, &tmp))) < shortest_dist) {
-                shortest_dist = dist;
-                closest = tmp;
-                progress = 1;
+            for (sign = 1; sign >= -1; sign -= 2) {
+                dx = sign * (i & 0x1);
+                dy = sign * ((i & 0x2) >> 1);
+                dz = sign * ((i & 0x4) >> 2);
+                stepper_move(&st, &current, dx, dy, dz, &tmp);
+                if ((dist = fabs(tmp.f)) < shortest_dist) {
+                    shortest_dist = dist;
+                    closest = tmp;
+                    step.x = surface->x + dx;
+                    step.y = surface->y + dy;
+                    step.z = surface->z + dz;
+                    progress = 1;
+                }
             }
         }
-        *surface = closest;
+        if (progress) {
+            current = closest;
+            *surface = step;
+        }
     }
+    stat_stop(search_ns, start);
+    stat_flush();
     return progress;
 }
 
-/* precondition: v is surface point
- * Depth first trace of all surface points
- * */
-void depth_first_surface(subspace *s, const quadric *q, const vector *v, int positive) {
-    /* if out of bounding volume */
-    if (v->x < s->x_min || v->x >= s->x_max ||
-            v->y < s->y_min || v->y >= s->y_max ||
-            v->z < s->z_min || v->z >= s->z_max)
-        return;
+/* Explicit stack for the depth first traversals, grown and shrunk a chunk
+ * at a time. One empty chunk is kept around so that pushing and popping
+ * across a chunk boundary does not allocate every time */
+#define STACK_CHUNK 4096
 
-    uint64_t index = _index(s, v->x, v->y, v->z);
-    /* if already visited */
-    if (sem_trywait(&s->points[index].sema) == -1 &&
-            errno == EAGAIN)
-        return;
+typedef struct _stack_chunk {
+    struct _stack_chunk *prev;
+    size_t count;
+    uint64_t points[STACK_CHUNK];
+} stack_chunk;
 
-    /* if not a surface point */
-    if (!is_surface(q, v))
-        return;
-    s->points[index].plotted = positive;
-    touch(s);
+typedef struct _point_stack {
+    stack_chunk *top, *spare;
+    size_t chunks, max_chunks;
+} point_stack;
+
+static void stack_init(point_stack *st, size_t limit) {
+    st->top = st->spare = NULL;
+    st->chunks = 0;
+    st->max_chunks = limit ? (limit + sizeof(stack_chunk) - 1) / 
+        sizeof(stack_chunk) : 0;
+}
+
+static int stack_push(point_stack *st, uint64_t p) {
+    stack_chunk *c = st->top;
+    if (!c || c->count == STACK_CHUNK) {
+        if (st->spare) {
+            c = st->spare;
+            st->spare = NULL;
+        } else {
+            if (st->max_chunks && st->chunks == st->max_chunks)
+                return 0;
+            if (!(c = (stack_chunk *)malloc(sizeof(stack_chunk))))
+                return 0;
+            st->chunks++;
+        }
+        c->prev = st->top;
+        c->count = 0;
+        st->top = c;
+    }
+    c->points[c->count++] = p;
+    return 1;
+}
+
+static int stack_pop(point_stack *st, uint64_t *p) {
+    stack_chunk *c = st->top;
+    if (!c)
+        return 0;
+    *p = c->points[--c->count];
+    if (!c->count) {
+        st->top = c->prev;
+        if (st->spare) {
+            free(st->spare);
+            st->chunks--;
+        }
+        st->spare = c;
+    }
+    return 1;
+}
+
+static void stack_free(point_stack *st) {
+    uint64_t p;
+    while (st->top)
+        stack_pop(st, &p);
+    free(st->spare);
+}
+
+/* The neighbours a traversal takes from the point packed in current: the
+ * ones inside s that are not visited yet and are surface points or, if
+ * fill is set, not exterior. Those are claimed, and their packed points
+ * and indices written to points and indices, which must hold 26 entries.
+ * Neighbours are claimed before they are classified, so that no traversal
+ * classifies them again, unless claim_accepted is set, in which case the
+ * rejected ones stay unvisited. Returns how many were taken */
+template <int shape, int fill, int claim_accepted>
+static inline int take_neighbours(subspace *s, const stepper *st,
+        uint64_t current, uint64_t *points, uint64_t *indices) {
+    int i, j, k, n = 0;
+    uint64_t index;
     vector tmp;
-    int i, j, k;
+    sample here, next;
+    tmp.x = unpack_x(s, current);
+    tmp.y = unpack_y(s, current);
+    tmp.z = unpack_z(s, current);
+    shaped_stepper_eval<shape>(st, &tmp, &here);
     for (i = -1; i <= 1; i++) {
         for (j = -1; j <= 1; j++) {
             for (k = -1; k <= 1; k++) {
                 if (!i && !j && !k)
                     continue;
-                tmp.x = v->x + i;
-                tmp.y = v->y + j;
-                tmp.z = v->z + k;
-                depth_first_surface(s, q, &tmp, positive);
+                tmp.x = unpack_x(s, current) + i;
+                tmp.y = unpack_y(s, current) + j;
+                tmp.z = unpack_z(s, current) + k;
+                if (!in_bounds(s, tmp.x, tmp.y, tmp.z)) {
+                    stat_add(out_of_bounds, 1);
+                    continue;
+                }
+                index = _index(s, tmp.x, tmp.y, tmp.z);
+                if (visited_point(s, index) ||
+                        (!claim_accepted && !claim_point(s, index))) {
+                    stat_add(revisits, 1);
+                    continue;
+                }
+                stepper_move(st, &here, i, j, k, &next);
+                if (fill ? sample_is_exterior(st, &next, &tmp) :
+                        !sample_is_surface(st, &next, &tmp)) {
+                    stat_add(rejected, 1);
+                    continue;
+                }
+                if (claim_accepted && !claim_point(s, index)) {
+                    stat_add(revisits, 1);
+                    continue;
+                }
+                stat_add(accepted, 1);
+                points[n] = pack_point(s, tmp.x, tmp.y, tmp.z);
+                indices[n++] = index;
             }
         }
     }
+    return n;
 }
 
-void depth_first_fill(subspace *s, const quadric *q, const vector *v, int positive) {
+/* precondition: v is surface point
+ * Depth first trace of all surface points. Points are claimed and
+ * classified when they are pushed, so the stack never holds more than one
+ * entry per surface point. Returns 1 once the trace is complete, 0 if the
+ * stack would have grown past s->stack_limit bytes or could not be
+ * allocated, in which case the trace stops early, if s is too large for
+ * pack_point or if a sparse s ran out of memory
+ * */
+template <int shape>
+static int depth_first_surface_shaped(subspace *s, const quadric *q,
+        const vector *v, int positive, int bias) {
+    point_stack stack;
+    stack_init(&stack, s->stack_limit);
+    uint64_t index, current, points[26], indices[26];
+    int i, n, complete = 1;
+    uint64_t surface_points = 0;
+    stepper st;
+    stat_start(start);
+    stepper_init(&st, q, bias);
+
+    if (!packable(s)) {
+        complete = 0;
+        goto done;
+    }
     /* if out of bounding volume */
-    if (v->x < s->x_min || v->x >= s->x_max ||
-            v->y < s->y_min || v->y >= s->y_max ||
-            v->z < s->z_min || v->z >= s->z_max)
-        return;
+    if (!in_bounds(s, v->x, v->y, v->z))
+        goto done;
+    index = _index(s, v->x, v->y, v->z);
+    /* if already visited or not a surface point */
+    if (!claim_point(s, index) || !is_surface(q, v, bias))
+        goto done;
+    plot_point(s, index, positive);
+    surface_points++;
+    if (!stack_push(&stack, pack_point(s, v->x, v->y, v->z))) {
+        complete = 0;
+        goto done;
+    }
 
-    uint64_t index = _index(s, v->x, v->y, v->z);
-    /* if already visited */
-    if (sem_trywait(&s->points[index].sema) == -1 &&
-            errno == EAGAIN)
-        return;
+    while (stack_pop(&stack, &current)) {
+        n = take_neighbours<shape, 0, 0>(s, &st, current, points,
+                indices);
+        for (i = 0; i < n; i++) {
+            plot_point(s, indices[i], positive);
+            if (complete && !stack_push(&stack, points[i]))
+                complete = 0;
+        }
+        surface_points += n;
+        if (!complete)
+            goto done;
+    }
+done:
+    stack_free(&stack);
+    stat_add(traversals, 1);
+    stat_stop(traverse_ns, start);
+    stat_flush();
+    __atomic_fetch_add(&s->points_plotted, surface_points, __ATOMIC_RELAXED);
+    return complete && !sparse_exhausted(s);
+}
 
-    /* if not a surface point */
-    if (!is_surface(q, v) && eval(q, v) > 0)
-        return;
+int depth_first_surface(subspace *s, const quadric *q, const vector *v,
+        int positive, int bias) {
+    shape_dispatch(q, depth_first_surface_shaped, (s, q, v, positive, bias));
+}
 
-    s->points[index].plotted = positive;
+template <int shape>
+static int depth_first_fill_shaped(subspace *s, const quadric *q,
+        const vector *v, int positive, int bias) {
+    point_stack stack;
+    stack_init(&stack, s->stack_limit);
+    uint64_t index, current, points[26], indices[26];
+    int i, n, complete = 1;
+    uint64_t surface_points = 0;
+    stepper st;
+    stat_start(start);
+    stepper_init(&st, q, bias);
 
-    touch(s);
-    vector tmp;
-    int i, j, k;
-    for (i = -1; i <= 1; i++) {
-        for (j = -1; j <= 1; j++) {
-            for (k = -1; k <= 1; k++) {
-                if (!i && !j && !k)
-                    continue;
-                tmp.x = v->x + i;
-                tmp.y = v->y + j;
-                tmp.z = v->z + k;
-                depth_first_fill(s, q, &tmp, positive);
-            }
+    if (!packable(s)) {
+        complete = 0;
+        goto done;
+    }
+    /* if out of bounding volume */
+    if (!in_bounds(s, v->x, v->y, v->z))
+        goto done;
+    index = _index(s, v->x, v->y, v->z);
+    /* if already visited */
+    if (!claim_point(s, index))
+        goto done;
+    /* if not a surface point */
+    if (!is_surface(q, v, bias) && eval(q, v, bias) > 0)
+        goto done;
+    plot_point(s, index, positive);
+    surface_points++;
+    if (!stack_push(&stack, pack_point(s, v->x, v->y, v->z))) {
+        complete = 0;
+        goto done;
+    }
+
+    while (stack_pop(&stack, &current)) {
+        n = take_neighbours<shape, 1, 0>(s, &st, current, points,
+                indices);
+        for (i = 0; i < n; i++) {
+            plot_point(s, indices[i], positive);
+            if (complete && !stack_push(&stack, points[i]))
+                complete = 0;
         }
+        surface_points += n;
+        if (!complete)
+            goto done;
     }
+done:
+    stack_free(&stack);
+    stat_add(traversals, 1);
+    stat_stop(traverse_ns, start);
+    stat_flush();
+    __atomic_fetch_add(&s->points_plotted, surface_points, __ATOMIC_RELAXED);
+    return complete && !sparse_exhausted(s);
+}
+
+int depth_first_fill(subspace *s, const quadric *q, const vector *v,
+        int positive, int bias) {
+    shape_dispatch(q, depth_first_fill_shaped, (s, q, v, positive, bias));
 }
 
 void print_func(void *data) {
     printf("%p\n", data); 
 }
 
-void breadth_first_surface(subspace *s, const quadric *q, const vector *v, int positive) {
-    std::list<vector *> queue = std::list<vector *>();
-    vector *tmp, *current = (vector *)malloc(sizeof(vector));
-    current->x = v->x; current->y = v->y; current->z = v->z; 
+/* Ring buffer of packed points used as the breadth first frontier. It only
+ * ever holds accepted points, each of them once, and grows by doubling, so
+ * a traversal makes O(log n) allocations in total */
+typedef struct _frontier {
+    uint64_t *points;
+    size_t head, count, capacity;
+} frontier;
 
-    queue.push_back(current);
-    int i, j, k;
-    uint64_t surface_points = 0;
-    while (!queue.empty()) {
-        current = queue.front();
-        queue.pop_front();
-        uint64_t index;
-        if (current->x < s->x_min || current->x >= s->x_max ||
-                current->y < s->y_min || current->y >= s->y_max ||
-                current->z < s->z_min || current->z >= s->z_max)
-            goto cleanup;
+static int frontier_init(frontier *f) {
+    f->head = f->count = 0;
+    f->capacity = 4096;
+    f->points = (uint64_t *)malloc(f->capacity * sizeof(uint64_t));
+    return f->points != NULL;
+}
 
-        index = _index(s, current->x, current->y, current->z);
+static int frontier_push(frontier *f, uint64_t p) {
+    if (f->count == f->capacity) {
+        uint64_t *points = (uint64_t *)realloc(f->points,
+                2 * f->capacity * sizeof(uint64_t));
+        if (!points)
+            return 0;
+        /* unwrap the part that sat before head */
+        memcpy(points + f->capacity, points, f->head * sizeof(uint64_t));
+        f->points = points;
+        f->capacity *= 2;
+    }
+    f->points[(f->head + f->count++) & (f->capacity - 1)] = p;
+    return 1;
+}
 
-        /* If point is not on surface, do not visit */
-        if(sem_trywait(&s->points[index].sema) == -1 &&
-                errno == EAGAIN)
-            goto cleanup;
+static int frontier_pop(frontier *f, uint64_t *p) {
+    if (!f->count)
+        return 0;
+    *p = f->points[f->head];
+    f->head = (f->head + 1) & (f->capacity - 1);
+    f->count--;
+    return 1;
+}
 
-        if (!is_surface(q, current))
-            goto cleanup;
+/* Neighbours are claimed and classified before they are enqueued, so
+ * out of bounds, visited and rejected points never reach the frontier.
+ * Returns 1 once the traversal is complete, 0 if the frontier could not be
+ * allocated, s is too large for pack_point or a sparse s ran out of
+ * memory */
+template <int shape>
+static int breadth_first_surface_shaped(subspace *s, const quadric *q,
+        const vector *v, int positive, int bias) {
+    frontier queue;
+    if (!frontier_init(&queue))
+        return 0;
+    uint64_t index, current, points[26], indices[26];
+    int i, n, complete = 1;
+    uint64_t surface_points = 0;
+    stepper st;
+    stat_start(start);
+    stepper_init(&st, q, bias);
 
-        s->points[index].plotted = positive;
-        touch(s); 
-
-        for (i = -1; i <= 1; i++) {
-            for (j = -1; j <= 1; j++) {
-                for (k = -1; k <= 1; k++) {
-                    if (!i && !j && !k)
-                        continue;
-                    tmp = (vector *)malloc(sizeof(vector));
-                    tmp->x = current->x + i;
-                    tmp->y = current->y + j;
-                    tmp->z = current->z + k;
-                    queue.push_back(tmp);
-                }
-            }
+    if (!packable(s)) {
+        complete = 0;
+        goto cleanup;
+    }
+    if (!in_bounds(s, v->x, v->y, v->z))
+        goto cleanup;
+    index = _index(s, v->x, v->y, v->z);
+    if (!claim_point(s, index) || !is_surface(q, v, bias))
+        goto cleanup;
+    plot_point(s, index, positive);
+    surface_points++;
+    if (!frontier_push(&queue, pack_point(s, v->x, v->y, v->z))) {
+        complete = 0;
+        goto cleanup;
+    }
+
+    while (frontier_pop(&queue, &current)) {
+        n = take_neighbours<shape, 0, 0>(s, &st, current, points,
+                indices);
+        for (i = 0; i < n; i++) {
+            plot_point(s, indices[i], positive);
+            if (complete && !frontier_push(&queue, points[i]))
+                complete = 0;
         }
-cleanup:
-        free(current);
+        surface_points += n;
+        if (!complete)
+            goto cleanup;
     }
-    return;
+cleanup:
+    free(queue.points);
+    stat_add(traversals, 1);
+    stat_stop(traverse_ns, start);
+    stat_flush();
+    __atomic_fetch_add(&s->points_plotted, surface_points, __ATOMIC_RELAXED);
+    return complete && !sparse_exhausted(s);
 }
 
-void breadth_first_fill(subspace *s, const quadric *q, const vector *v, int positive) {
-    std::list<vector *> queue = std::list<vector *>();
-    vector *tmp, *current = (vector *)malloc(sizeof(vector));
-    current->x = v->x; current->y = v->y; current->z = v->z; 
+int breadth_first_surface(subspace *s, const quadric *q, const vector *v,
+        int positive, int bias) {
+    shape_dispatch(q, breadth_first_surface_shaped, (s, q, v, positive, bias));
+}
 
-    queue.push_back(current);
-    int i, j, k;
+template <int shape>
+static int breadth_first_fill_shaped(subspace *s, const quadric *q,
+        const vector *v, int positive, int bias) {
+    frontier queue;
+    if (!frontier_init(&queue))
+        return 0;
+    uint64_t index, current, points[26], indices[26];
+    int i, n, complete = 1;
     uint64_t surface_points = 0;
-    while (!queue.empty()) {
-        current = queue.front();
-        queue.pop_front();
-        uint64_t index;
-        if (current->x < s->x_min || current->x >= s->x_max ||
-                current->y < s->y_min || current->y >= s->y_max ||
-                current->z < s->z_min || current->z >= s->z_max)
-            goto cleanup;
+    stepper st;
+    stat_start(start);
+    stepper_init(&st, q, bias);
 
-        index = _index(s, current->x, current->y, current->z);
-        
-        /* If point is not on surface or the interior, do not visit */
-        if (!is_surface(q, current) && eval(q, current) > 0) {
-            goto cleanup;
-        }
-
-        if(sem_trywait(&s->points[index].sema) == -1 &&
-                errno == EAGAIN)
-            goto cleanup;
+    if (!packable(s)) {
+        complete = 0;
+        goto cleanup;
+    }
+    if (!in_bounds(s, v->x, v->y, v->z))
+        goto cleanup;
+    index = _index(s, v->x, v->y, v->z);
+    if ((!is_surface(q, v, bias) && eval(q, v, bias) > 0) || !claim_point(s, index))
+        goto cleanup;
+    plot_point(s, index, positive);
+    surface_points++;
+    if (!frontier_push(&queue, pack_point(s, v->x, v->y, v->z))) {
+        complete = 0;
+        goto cleanup;
+    }
 
-        s->points[index].plotted = positive;
-        touch(s); 
-        for (i = -1; i <= 1; i++) {
-            for (j = -1; j <= 1; j++) {
-                for (k = -1; k <= 1; k++) {
-                    if (!i && !j && !k)
-                        continue;
-                    tmp = (vector *)malloc(sizeof(vector));
-                    tmp->x = current->x + i;
-                    tmp->y = current->y + j;
-                    tmp->z = current->z + k;
-                    queue.push_back(tmp);
-                }
-            }
+    while (frontier_pop(&queue, &current)) {
+        n = take_neighbours<shape, 1, 1>(s, &st, current, points,
+                indices);
+        for (i = 0; i < n; i++) {
+            plot_point(s, indices[i], positive);
+            if (complete && !frontier_push(&queue, points[i]))
+                complete = 0;
         }
+        surface_points += n;
+        if (!complete)
+            goto cleanup;
+    }
 cleanup:
-        free(current);
+    free(queue.points);
+    stat_add(traversals, 1);
+    stat_stop(traverse_ns, start);
+    stat_flush();
+    __atomic_fetch_add(&s->points_plotted, surface_points, __ATOMIC_RELAXED);
+    return complete && !sparse_exhausted(s);
+}
+
+int breadth_first_fill(subspace *s, const quadric *q, const vector *v,
+        int positive, int bias) {
+    shape_dispatch(q, breadth_first_fill_shaped, (s, q, v, positive, bias));
+}
+
+/* Surface points waiting to be handed to a visitor */
+typedef struct _point_batch {
+    uint64_t *points;
+    size_t count;
+    point_visitor visit;
+    void *ctx;
+} point_batch;
+
+/* Hands the batch to the visitor. Returns 0 if the visitor asked to stop */
+static int batch_flush(point_batch *b) {
+    if (!b->count)
+        return 1;
+    size_t n = b->count;
+    b->count = 0;
+    return b->visit(b->ctx, b->points, n);
+}
+
+static int batch_add(point_batch *b, uint64_t p) {
+    b->points[b->count++] = p;
+    return b->count < STREAM_BATCH || batch_flush(b);
+}
+
+/* Depth first trace like depth_first_surface that adds the surface points
+ * to a batch instead of plotting them */
+template <int shape>
+static int stream_surface_shaped(subspace *s, const quadric *q,
+        const vector *v, int bias, point_batch *batch) {
+    point_stack stack;
+    stack_init(&stack, s->stack_limit);
+    uint64_t index, current, p, points[26], indices[26];
+    int i, n, complete = 1;
+    stepper st;
+    stepper_init(&st, q, bias);
+
+    if (!packable(s)) {
+        complete = 0;
+        goto done;
+    }
+    if (!in_bounds(s, v->x, v->y, v->z))
+        goto done;
+    index = _index(s, v->x, v->y, v->z);
+    if (!claim_point(s, index) || !is_surface(q, v, bias))
+        goto done;
+    p = pack_point(s, v->x, v->y, v->z);
+    if (!batch_add(batch, p) || !stack_push(&stack, p)) {
+        complete = 0;
+        goto done;
     }
-    return;
+
+    while (stack_pop(&stack, &current)) {
+        n = take_neighbours<shape, 0, 0>(s, &st, current, points,
+                indices);
+        for (i = 0; complete && i < n; i++)
+            complete = batch_add(batch, points[i]) &&
+                stack_push(&stack, points[i]);
+        if (!complete)
+            goto done;
+    }
+done:
+    stack_free(&stack);
+    return complete;
+}
+
+static int stream_surface_from(subspace *s, const quadric *q,
+        const vector *v, int bias, point_batch *batch) {
+    shape_dispatch(q, stream_surface_shaped, (s, q, v, bias, batch));
+}
+
+/* Traces the surface points connected to the seeds and hands them to
+ * visit, packed with pack_point(s, ...), in batches of up to STREAM_BATCH
+ * while the trace runs. Nothing is plotted: s only records which points
+ * have been visited, so that each point is emitted once, and a sparse s
+ * keeps that to the bricks around the surface. The trace waits for visit
+ * to return, which is how slow consumers hold it back.
+ *
+ * Returns 1 once every point has been handed over, 0 if visit returned 0,
+ * the stack could not grow, a sparse s ran out of memory or s is too large
+ * for pack_point */
+int stream_surface(subspace *s, const quadric *q, const vector *seeds,
+        size_t num_seeds, int bias, point_visitor visit, void *ctx) {
+    point_batch batch;
+    batch.points = (uint64_t *)malloc(STREAM_BATCH * sizeof(uint64_t));
+    batch.count = 0;
+    batch.visit = visit;
+    batch.ctx = ctx;
+    if (!batch.points)
+        return 0;
+    size_t i;
+    int complete = 1;
+    stat_start(start);
+    for (i = 0; complete && i < num_seeds; i++)
+        complete = stream_surface_from(s, q, &seeds[i], bias, &batch);
+    if (complete)
+        complete = batch_flush(&batch);
+    free(batch.points);
+    stat_add(traversals, 1);
+    stat_stop(traverse_ns, start);
+    stat_flush();
+    return complete && !sparse_exhausted(s);
 }
 
 void print_subspace(const subspace *s) {
@@ -1,7 +1,9 @@
 #ifndef QUADRIC_H
 #define QUADRIC_H
 #include <stdint.h>
-#include <semaphore.h>
+#include <stddef.h>
+#include <math.h>
+#include <float.h>
 
 /* Quadratic surfaces are also called quadrics, and there are 17 
  * standard-form types. A quadratic surface intersects every plane in a 
@@ -12,27 +14,158 @@
 
 /* ax^2 + by^2 + cz^2 + 2fyz + 2gzx + 2hxy + 2px + 2qy + 2rz + d = 0. */
 
-#define _index(s, x, y, z) (\
-    ((x) - (s)->x_min) * ((s)->y_max - (s)->y_min) * ((s)->z_max - (s)->z_min) + \
-    ((y) - (s)->y_min) * ((s)->z_max - (s)->z_min) + \
-    ((z) - (s)->z_min)\
-)
+/* Brick layout for dense subspaces: 8^3 bricks of 512 bits, so all 26
+ * neighbours of a point are usually within a few cache lines */
+#define BRICK_SHIFT 3
+
+#define extent(s, a) ((s)->a##_max - (s)->a##_min)
+
+/* Points are numbered row major, z fastest, unless the subspace stores them
+ * in bricks of 2^brick_shift points a side. Bricks are grouped into blocks
+ * of 2^table_shift bricks a side, blocks are numbered row major and points
+ * within a brick and bricks within a block are numbered row major as well,
+ * so a brick is a contiguous run of indices and so is a block */
+#define block_shift(s) ((s)->brick_shift + (s)->table_shift)
+#define blocks(s, a) ((extent(s, a) + ((int64_t)1 << block_shift(s)) - 1) >> \
+        block_shift(s))
+#define _bits(v, shift, n) (((uint64_t)(v) >> (shift)) & \
+        (((uint64_t)1 << (n)) - 1))
+#define _brick_offset(s, rx, ry, rz) ( \
+    _bits(rx, (s)->brick_shift, (s)->table_shift) << \
+        (2 * (s)->table_shift + 3 * (s)->brick_shift) | \
+    _bits(ry, (s)->brick_shift, (s)->table_shift) << \
+        ((s)->table_shift + 3 * (s)->brick_shift) | \
+    _bits(rz, (s)->brick_shift, (s)->table_shift) << 3 * (s)->brick_shift | \
+    _bits(rx, 0, (s)->brick_shift) << 2 * (s)->brick_shift | \
+    _bits(ry, 0, (s)->brick_shift) << (s)->brick_shift | \
+    _bits(rz, 0, (s)->brick_shift))
+#define _brick_index(s, rx, ry, rz) ( \
+    (((uint64_t)((rx) >> block_shift(s)) * blocks(s, y) + \
+      (uint64_t)((ry) >> block_shift(s))) * blocks(s, z) + \
+      (uint64_t)((rz) >> block_shift(s))) << 3 * block_shift(s) | \
+    _brick_offset(s, rx, ry, rz))
+
+/* _brick_index with the shifts of the dense brick layout known up front */
+#define _brick8_index(s, rx, ry, rz) ( \
+    (((uint64_t)((rx) >> 3) * ((extent(s, y) + 7) >> 3) + \
+      (uint64_t)((ry) >> 3)) * ((extent(s, z) + 7) >> 3) + \
+      (uint64_t)((rz) >> 3)) << 9 | \
+    ((uint64_t)(rx) & 7) << 6 | ((uint64_t)(ry) & 7) << 3 | \
+    ((uint64_t)(rz) & 7))
+#define _index(s, px, py, pz) ((s)->brick_shift ? \
+    (s)->brick_shift == BRICK_SHIFT && !(s)->table_shift ? \
+    _brick8_index(s, (int64_t)(px) - (s)->x_min, \
+        (int64_t)(py) - (s)->y_min, (int64_t)(pz) - (s)->z_min) : \
+    _brick_index(s, (int64_t)(px) - (s)->x_min, \
+        (int64_t)(py) - (s)->y_min, (int64_t)(pz) - (s)->z_min) : \
+    (uint64_t)(((px) - (s)->x_min) * extent(s, y) * extent(s, z) + \
+        ((py) - (s)->y_min) * extent(s, z) + ((pz) - (s)->z_min)))
 
 #define frozen_point(s, x) (((s)->points[x / 8] & 1 << (x % 8)) >> x % 8)
 
-#define _x(s, index) ((index) / ((s)->y_max - (s)->y_min) / \
-        ((s)->z_max - (s)->z_min) + (s)->x_min)
-#define _y(s, index) ((index) % (((s)->y_max - (s)->y_min) * \
-        ((s)->z_max - (s)->z_min)) / ((s)->z_max - (s)->z_min) + (s)->y_min)
-#define _z(s, index) ((index) % (((s)->y_max - (s)->y_min) * \
-        ((s)->z_max - (s)->z_min)) % ((s)->z_max - (s)->z_min) + (s)->z_min)
+#define bitfield_words(n) (((n) + 63) / 64)
+#define point_bit(x) ((uint64_t)1 << ((x) % 64))
+
+/* Atomically marks point x of s as visited. Nonzero if the caller is the
+ * first to visit it. Only the claim itself has to be atomic, so relaxed
+ * ordering is enough. Sparse subspaces allocate the brick holding x on
+ * first touch */
+#define claim_point(s, x) ((s)->bricks ? sparse_claim(s, x) : \
+        !(__atomic_fetch_or(&(s)->visited[(x) / 64], point_bit(x), \
+            __ATOMIC_RELAXED) & point_bit(x)))
+
+/* Neighbouring points share a word, so plotting must be atomic as well */
+#define plot_point(s, x, positive) ((s)->bricks ? \
+        sparse_plot(s, x, positive) : (positive) ? \
+        __atomic_fetch_or(&(s)->plotted[(x) / 64], point_bit(x), \
+            __ATOMIC_RELAXED) : \
+        __atomic_fetch_and(&(s)->plotted[(x) / 64], ~point_bit(x), \
+            __ATOMIC_RELAXED))
+
+/* Other threads may be claiming or plotting in the same word, so the
+ * tests load it atomically as well */
+#define visited_point(s, x) ((s)->bricks ? sparse_test(s, x, 0) : \
+        (__atomic_load_n(&(s)->visited[(x) / 64], __ATOMIC_RELAXED) >> \
+            ((x) % 64)) & 1)
+#define plotted_point(s, x) ((s)->bricks ? sparse_test(s, x, 1) : \
+        (__atomic_load_n(&(s)->plotted[(x) / 64], __ATOMIC_RELAXED) >> \
+            ((x) % 64)) & 1)
+
+/* Sparse subspaces keep their points in bricks of 16^3, in tables of 8^3
+ * bricks, both allocated the first time a point in them is claimed */
+#define SPARSE_BRICK_SHIFT 4
+#define SPARSE_TABLE_SHIFT 3
+#define brick_words(s) bitfield_words((uint64_t)1 << 3 * (s)->brick_shift)
+#define table_size(s) ((size_t)1 << 3 * (s)->table_shift)
+#define sparse_exhausted(s) __atomic_load_n(&(s)->exhausted, \
+        __ATOMIC_RELAXED)
+
+/* Coordinates of the point with the given index */
+#define _block(s, index) ((uint64_t)(index) >> 3 * block_shift(s))
+#define _brick_x(s, index) ((int64_t)( \
+    _block(s, index) / blocks(s, y) / blocks(s, z) << block_shift(s) | \
+    _bits(index, 2 * (s)->table_shift + 3 * (s)->brick_shift, \
+        (s)->table_shift) << (s)->brick_shift | \
+    _bits(index, 2 * (s)->brick_shift, (s)->brick_shift)) + (s)->x_min)
+#define _brick_y(s, index) ((int64_t)( \
+    _block(s, index) / blocks(s, z) % blocks(s, y) << block_shift(s) | \
+    _bits(index, (s)->table_shift + 3 * (s)->brick_shift, \
+        (s)->table_shift) << (s)->brick_shift | \
+    _bits(index, (s)->brick_shift, (s)->brick_shift)) + (s)->y_min)
+#define _brick_z(s, index) ((int64_t)( \
+    _block(s, index) % blocks(s, z) << block_shift(s) | \
+    _bits(index, 3 * (s)->brick_shift, (s)->table_shift) << \
+        (s)->brick_shift | \
+    _bits(index, 0, (s)->brick_shift)) + (s)->z_min)
+
+#define _x(s, index) ((s)->brick_shift ? _brick_x(s, index) : \
+        (int64_t)((index) / extent(s, y) / extent(s, z) + (s)->x_min))
+#define _y(s, index) ((s)->brick_shift ? _brick_y(s, index) : \
+        (int64_t)((index) % (extent(s, y) * extent(s, z)) / extent(s, z) + \
+            (s)->y_min))
+#define _z(s, index) ((s)->brick_shift ? _brick_z(s, index) : \
+        (int64_t)((index) % (extent(s, y) * extent(s, z)) % extent(s, z) + \
+            (s)->z_min))
+
+/* Packs a point of s into 21 bits per axis, relative to the lower bounds,
+ * for frontiers that would otherwise hold three doubles per point. Only
+ * valid if packable(s); the traversals that pack points fail on larger
+ * subspaces rather than wrap coordinates around */
+#define PACK_BITS 21
+#define packable(s) (extent(s, x) <= (int64_t)1 << PACK_BITS && \
+        extent(s, y) <= (int64_t)1 << PACK_BITS && \
+        extent(s, z) <= (int64_t)1 << PACK_BITS)
+#define pack_point(s, x, y, z) ((uint64_t)((x) - (s)->x_min) << 42 | \
+        (uint64_t)((y) - (s)->y_min) << 21 | (uint64_t)((z) - (s)->z_min))
+#define unpack_x(s, p) ((int64_t)((p) >> 42) + (s)->x_min)
+#define unpack_y(s, p) ((int64_t)((p) >> 21 & 0x1fffff) + (s)->y_min)
+#define unpack_z(s, p) ((int64_t)((p) & 0x1fffff) + (s)->z_min)
 
-#define touch(s) (sem_post(&(s)->points_plotted))
+#define in_bounds(s, x, y, z) ((x) >= (s)->x_min && (x) < (s)->x_max && \
+        (y) >= (s)->y_min && (y) < (s)->y_max && \
+        (z) >= (s)->z_min && (z) < (s)->z_max)
+
+/* How evaluations sign a value of F that is exactly 0: as the exterior,
+ * positive, or as the interior, negative. Every evaluation takes its bias
+ * as an argument, so threads may use different ones at the same time */
+#define BIAS_EXTERIOR 0
+#define BIAS_INTERIOR 1
+
+/* Bound on the terms of F below which quadric_is_exact quadrics evaluate
+ * exactly */
+#define EXACT_MAGNITUDE 1e15
+/* Rounding error of a stepper step, relative to the terms involved */
+#define STEP_ERROR (8 * DBL_EPSILON)
 
 #define volume(s) ((size_t)(((s)->x_max - (s)->x_min) * \
         ((s)->y_max - (s)->y_min) * \
         ((s)->z_max - (s)->z_min)))
 
+/* Number of indices in the layout of s, the volume rounded up to whole
+ * blocks */
+#define index_space(s) ((size_t)(blocks(s, x) * blocks(s, y) * \
+            blocks(s, z)) << 3 * block_shift(s))
+
 
 typedef struct _quadric {
     double a, b, c, d, e, f, g, h, i, j;
@@ -42,25 +175,184 @@ typedef struct _vector {
     double x, y, z;
 } vector;
 
-typedef struct _point {
-    int64_t x, y, z;
-    sem_t sema;
-    uint8_t plotted;
-} point;
-
 typedef struct _subspace {
     int64_t x_min, y_min, z_min, x_max, y_max, z_max; 
-    sem_t points_plotted;
-    point *points;
+    /* Layout of the points, see _index. Both 0 for row major, the
+     * default */
+    int brick_shift, table_shift;
+    /* Number of points plotted. Each traversal counts locally and adds
+     * its total once it finishes */
+    uint64_t points_plotted;
+    /* Most memory in bytes a depth first traversal of this subspace may
+     * use for its stack, 0 for no limit */
+    size_t stack_limit;
+    /* Bit fields for each point in the bounding volume. On little endian
+     * machines the words have the same layout as frozen_subspace. visited
+     * is set once a traversal has claimed the point, plotted holds the
+     * value the traversal wrote to it. The coordinates of a point are
+     * recovered from its index with _x, _y and _z. NULL for sparse
+     * subspaces */
+    uint64_t *visited;
+    uint64_t *plotted;
+    /* Sparse subspaces only, NULL otherwise. One table of bricks per
+     * block, each brick holding its visited words followed by its plotted
+     * words */
+    uint64_t ***bricks;
+    uint64_t bricks_allocated;
+    /* Set by whichever thread failed to allocate a brick, see
+     * sparse_exhausted. Its points are treated as visited and never
+     * plotted, and the traversal reports that it is incomplete */
+    int exhausted;
 } subspace;
 
+/* Incremental evaluation of a quadric on the integer lattice. A unit step
+ * changes F by a linear function of the position, so once F and its
+ * gradient are known at one point, F and the gradient at each of the 26
+ * neighbours follow from a handful of additions instead of a full 10 term
+ * evaluation. The tables are indexed by (dx + 1) * 9 + (dy + 1) * 3 +
+ * dz + 1. */
+typedef struct _stepper {
+    /* change in F and in its gradient for each unit offset, on top of the
+     * gradient term */
+    double df[27], dgx[27], dgy[27], dgz[27];
+    /* F(v + e/2) = F(v) + g/2 + quarter */
+    double quarter_x, quarter_y, quarter_z;
+    /* nonzero if all coefficients are small integers, in which case every
+     * value the stepper produces is exact */
+    int exact;
+    /* BIAS_EXTERIOR or BIAS_INTERIOR, for the evaluations falling back to
+     * is_surface */
+    int bias;
+    const quadric *q;
+} stepper;
+
+/* F and its gradient at a lattice point. err bounds how far f and the
+ * half step values derived from it may be from what eval would return. It
+ * is 0 when they are exact; otherwise values within err of 0 are
+ * classified with is_surface instead */
+typedef struct _sample {
+    double f, gx, gy, gz;
+    double err;
+} sample;
+
+/* What the engines did, for tuning. Counters are kept per thread and added
+ * to process wide totals when a traversal ends; they only exist when the
+ * library is built with QUADRIC_STATS defined, and every stat_ macro
+ * compiles to nothing otherwise */
+typedef struct _quadric_stats {
+    /* Traversal calls, full evaluations of F, incremental stepper moves,
+     * and sample classifications that fell back to is_surface */
+    uint64_t traversals, evals, steps, fallbacks;
+    /* Neighbours looked at by the DFS, BFS and work stealing traversals:
+     * outside the subspace, visited or claimed already, classified and
+     * rejected, and accepted */
+    uint64_t out_of_bounds, revisits, rejected, accepted;
+    /* Steps of find_surface's walk */
+    uint64_t search_steps;
+    /* Work stealing: successful steals, and deque locks that were held by
+     * another thread */
+    uint64_t steals, contended;
+    /* Nanoseconds spent creating subspaces, looking for seeds, traversing
+     * or rasterizing, and waiting for contended deque locks */
+    uint64_t init_ns, search_ns, traverse_ns, wait_ns;
+} quadric_stats;
+
+#ifdef QUADRIC_STATS
+#include <time.h>
+extern __thread quadric_stats local_stats;
+#define stat_add(field, n) (local_stats.field += (n))
+#define stat_start(t) struct timespec t; clock_gettime(CLOCK_MONOTONIC, &t)
+#define stat_stop(field, t) do { \
+        struct timespec stat_end; \
+        clock_gettime(CLOCK_MONOTONIC, &stat_end); \
+        stat_add(field, 1000000000 * (stat_end.tv_sec - (t).tv_sec) + \
+                stat_end.tv_nsec - (t).tv_nsec); \
+    } while (0)
+#define stat_flush() quadric_stats_flush()
+#else
+#define stat_add(field, n) ((void)0)
+#define stat_start(t)
+#define stat_stop(field, t) ((void)0)
+#define stat_flush() ((void)0)
+#endif
+
+/* Surface points are handed to visitors this many at a time at most */
+#define STREAM_BATCH 4096
+
+/* Receives n surface points packed with pack_point. Returning 0 stops the
+ * traversal */
+typedef int (*point_visitor)(void *, const uint64_t *, size_t);
+
+/* How scanline_batch combines its quadrics */
+#define BATCH_UNION 0
+#define BATCH_INTERSECTION 1
+#define BATCH_LABEL 2
+
+#define ROW_PROBES 5
+
+/* Kernels of classify_row, see classify_row_kernel */
+#define CLASSIFY_SCALAR 0
+#define CLASSIFY_AVX2 1
+#define CLASSIFY_AVX512 2
+
+/* F along the row (x, y, z + t), t = 0 .. n - 1, and along the parallel
+ * rows through the half step neighbours is_surface probes: c t^2 + b[p] t +
+ * k[p] for the probes at x, x + 1/2, x - 1/2, y + 1/2 and y - 1/2. The
+ * probes at z +- 1/2 are the first quadratic at t +- 1/2. Values computed
+ * from a row may be up to tol away from what eval returns; tol is 0 when
+ * they are exact */
+typedef struct _row {
+    double c;
+    double b[ROW_PROBES], k[ROW_PROBES];
+    double tol;
+} row;
+
 typedef struct _frozen_subspace {
     int64_t x_min, y_min, z_min, x_max, y_max, z_max; 
-    /* Bit field for each point in the bounding volume. 1 if it is plotted,
-     * 0 otherwise */
+    /* Layout of the points, as for subspace */
+    int brick_shift, table_shift;
+    /* Bit field for each index of the layout, see _index. 1 if the point
+     * is plotted, 0 otherwise */
     uint8_t *points;
+    /* Occupancy pyramid of levels levels, see frozen_subspace_pyramid,
+     * NULL if it has not been built. Part of the mapping if there is one */
+    uint8_t *pyramid;
+    int levels;
+    /* Set if points lives in a read only mapping of a file, see
+     * frozen_subspace_map, NULL if it was allocated */
+    void *mapping;
+    size_t mapped;
 } frozen_subspace;
 
+/* Cubes of 2^level points a side along axis a of a frozen subspace, and
+ * in the whole of it. Cubes are aligned on the lower bounds */
+#define level_extent(f, level, a) \
+    ((extent(f, a) + ((int64_t)1 << (level)) - 1) >> (level))
+#define level_bits(f, level) ((uint64_t)level_extent(f, level, x) * \
+        level_extent(f, level, y) * level_extent(f, level, z))
+
+/* The points lo <= z < hi of a row */
+typedef struct _span {
+    int64_t lo, hi;
+} span;
+
+/* A frozen subspace stored as runs of plotted points. Each row of constant
+ * x and y holds a sorted list of disjoint, non adjacent spans along z, so
+ * solids take a couple of spans per row instead of a bit per point. The
+ * spans of row r = (x - x_min) * (y_max - y_min) + y - y_min are
+ * spans[rows[r]] up to spans[rows[r + 1]] */
+typedef struct _span_subspace {
+    int64_t x_min, y_min, z_min, x_max, y_max, z_max; 
+    uint64_t *rows;
+    span *spans;
+    uint64_t num_spans;
+} span_subspace;
+
+#define span_row_index(s, x, y) ((uint64_t)((x) - (s)->x_min) * \
+        ((s)->y_max - (s)->y_min) + (uint64_t)((y) - (s)->y_min))
+#define num_rows(s) ((uint64_t)((s)->x_max - (s)->x_min) * \
+        ((s)->y_max - (s)->y_min))
+
 typedef struct _node {
     void *data;
     struct _node *prev;
@@ -74,18 +366,82 @@ typedef struct _list {
 
 subspace *subspace_init(int64_t, int64_t, int64_t, 
         int64_t, int64_t, int64_t);
+subspace *subspace_init_layout(int64_t, int64_t, int64_t, 
+        int64_t, int64_t, int64_t, int);
+subspace *subspace_init_sparse(int64_t, int64_t, int64_t, 
+        int64_t, int64_t, int64_t);
 void subspace_free(subspace *);
+int sparse_claim(subspace *, uint64_t);
+uint64_t sparse_plot(subspace *, uint64_t, int);
+int sparse_test(const subspace *, uint64_t, int);
+uint64_t claim_run(subspace *, int64_t, int64_t, int64_t, uint64_t, int);
+uint64_t release_run(subspace *, int64_t, int64_t, int64_t, uint64_t);
+uint64_t visited_run(const subspace *, int64_t, int64_t, int64_t, uint64_t);
+frozen_subspace *subspace_freeze(const subspace *);
 void frozen_subspace_free(frozen_subspace *);
 double eval_int(const quadric *, const vector *);
 double eval_ext(const quadric *, const vector *);
-int is_surface(const quadric *, const vector *);
+int is_surface(const quadric *, const vector *, int);
+int quadric_is_exact(const quadric *);
+void row_init(row *, const quadric *, int64_t, int64_t, int64_t, size_t);
+void classify_row(const quadric *, int64_t, int64_t, int64_t, size_t,
+        uint64_t *, uint64_t *);
+int classify_row_kernel(int, const quadric *, int64_t, int64_t, int64_t,
+        size_t, uint64_t *, uint64_t *);
+void stepper_init(stepper *, const quadric *, int);
+void stepper_eval(const stepper *, const vector *, sample *);
+void stepper_move(const stepper *, const sample *, int, int, int, sample *);
+int sample_is_surface(const stepper *, const sample *, const vector *);
+int sample_is_exterior(const stepper *, const sample *, const vector *);
+span_subspace *subspace_spans(const subspace *);
+span_subspace *frozen_subspace_spans(const frozen_subspace *);
+frozen_subspace *span_subspace_freeze(const span_subspace *);
+int frozen_subspace_pyramid(frozen_subspace *);
+uint8_t *pyramid_build(const frozen_subspace *, int *);
+size_t pyramid_bytes(const frozen_subspace *);
+int pyramid_levels(const frozen_subspace *);
+int frozen_cube(const frozen_subspace *, int, int64_t, int64_t, int64_t);
+int frozen_box(const frozen_subspace *, const int64_t *, const int64_t *);
+frozen_subspace *frozen_subspace_level(const frozen_subspace *, int);
+void span_subspace_free(span_subspace *);
+int span_point(const span_subspace *, int64_t, int64_t, int64_t);
+const span *span_row(const span_subspace *, int64_t, int64_t, size_t *);
+uint64_t span_count(const span_subspace *);
+span_subspace *span_union(const span_subspace *, const span_subspace *);
+span_subspace *span_intersection(const span_subspace *, 
+        const span_subspace *);
 void print_vector(const vector *v);
 void print_subspace(const subspace *s);
-int find_surface(quadric *q, const vector *, vector *);
-void depth_first_surface(subspace *, const quadric *, const vector *, int);
-void breadth_first_surface(subspace *, const quadric *, const vector *, int);
-void depth_first_fill(subspace *, const quadric *, const vector *, int);
-void breadth_first_fill(subspace *, const quadric *, const vector *, int);
+int find_surface(quadric *q, const vector *, vector *, int);
+int depth_first_surface(subspace *, const quadric *, const vector *, int,
+        int);
+int breadth_first_surface(subspace *, const quadric *, const vector *, int,
+        int);
+int depth_first_fill(subspace *, const quadric *, const vector *, int,
+        int);
+int breadth_first_fill(subspace *, const quadric *, const vector *, int,
+        int);
+int parallel_surface(subspace *, const quadric *, const vector *, size_t,
+        int, int, int);
+int parallel_fill(subspace *, const quadric *, const vector *, size_t,
+        int, int, int);
+int scanline_surface(subspace *, const quadric *, int, int);
+int scanline_fill(subspace *, const quadric *, int, int, int);
+int scanline_batch(subspace *, const quadric *, size_t, int, int, int,
+        int32_t *, int);
+int octree_surface(subspace *, const quadric *, int, int);
+int stream_surface(subspace *, const quadric *, const vector *, size_t,
+        int, point_visitor, void *);
+int octree_fill(subspace *, const quadric *, int, int, int);
+int octree_update(subspace *, const quadric *, const quadric *, int, int,
+        int, int);
+int quadric_bounds(const quadric *, const subspace *, int, int64_t *);
+size_t quadric_seeds(const quadric *, const subspace *, vector *, size_t,
+        int);
+void quadric_stats_flush(void);
+void quadric_stats_get(quadric_stats *);
+void quadric_stats_thread(quadric_stats *);
+void quadric_stats_reset(void);
 list *new_list();
 void *pop(list *);
 void *peek(list *);
@@ -94,5 +450,89 @@ void list_destroy(list *);
 void print_list(list *, void (*)(void *));
 int empty(list *);
 
-double eval_ext(const quadric *, const vector *);
+
+/* Shapes of quadrics with evaluators of their own, by which groups of
+ * coefficients are all zero: the cross terms d, e and f, and the linear
+ * terms g, h and i. Spheres and ellipsoids about the origin are
+ * QUADRIC_AXIS_ALIGNED */
+#define QUADRIC_GENERAL 0
+#define QUADRIC_NO_CROSS 1
+#define QUADRIC_CENTERED 2
+#define QUADRIC_AXIS_ALIGNED (QUADRIC_NO_CROSS | QUADRIC_CENTERED)
+
+int quadric_shape(const quadric *);
+
+/* Returns fn<shape> args for the shape of q, so that the shape is looked
+ * at once per call rather than once per point */
+#define shape_dispatch(q, fn, args) \
+    switch (quadric_shape(q)) { \
+    case QUADRIC_AXIS_ALIGNED: \
+        return fn<QUADRIC_AXIS_ALIGNED> args; \
+    case QUADRIC_CENTERED: \
+        return fn<QUADRIC_CENTERED> args; \
+    case QUADRIC_NO_CROSS: \
+        return fn<QUADRIC_NO_CROSS> args; \
+    default: \
+        return fn<QUADRIC_GENERAL> args; \
+    }
+
+/* F at v, leaving out the terms the shape rules out. Adding the zeros they
+ * would have given changes nothing, so the value is the one eval returns */
+template <int shape>
+static inline double shaped_eval(const quadric *q, const vector *v,
+        int bias) {
+    stat_add(evals, 1);
+    double result = q->a * v->x * v->x;
+    result += q->b * v->y * v->y;
+    result += q->c * v->z * v->z;
+    if (!(shape & QUADRIC_NO_CROSS)) {
+        result += q->d * v->y * v->z;
+        result += q->e * v->x * v->z;
+        result += q->f * v->x * v->y;
+    }
+    if (!(shape & QUADRIC_CENTERED)) {
+        result += q->g * v->x;
+        result += q->h * v->y;
+        result += q->i * v->z;
+    }
+    result += q->j;
+    if (result == 0.0)
+        return bias == BIAS_INTERIOR ? -0.0 : 0.0;
+    return result;
+}
+
+/* F at v, a zero given the sign bias calls for */
+static inline double eval(const quadric *q, const vector *v, int bias) {
+    return shaped_eval<QUADRIC_GENERAL>(q, v, bias);
+}
+
+/* stepper_eval for a quadric of the given shape */
+template <int shape>
+static inline void shaped_stepper_eval(const stepper *st, const vector *v,
+        sample *out) {
+    const quadric *q = st->q;
+    double magnitude = fabs(q->a * v->x * v->x) + fabs(q->b * v->y * v->y) +
+        fabs(q->c * v->z * v->z) + fabs(q->j);
+    out->f = shaped_eval<shape>(q, v, st->bias);
+    out->gx = 2 * q->a * v->x;
+    out->gy = 2 * q->b * v->y;
+    out->gz = 2 * q->c * v->z;
+    if (!(shape & QUADRIC_NO_CROSS)) {
+        out->gx = out->gx + q->f * v->y + q->e * v->z;
+        out->gy = q->f * v->x + out->gy + q->d * v->z;
+        out->gz = q->e * v->x + q->d * v->y + out->gz;
+        magnitude += fabs(q->d * v->y * v->z) + fabs(q->e * v->x * v->z) +
+            fabs(q->f * v->x * v->y);
+    }
+    if (!(shape & QUADRIC_CENTERED)) {
+        out->gx += q->g;
+        out->gy += q->h;
+        out->gz += q->i;
+        magnitude += fabs(q->g * v->x) + fabs(q->h * v->y) +
+            fabs(q->i * v->z);
+    }
+    magnitude += fabs(out->gx) + fabs(out->gy) + fabs(out->gz);
+    out->err = st->exact && magnitude < EXACT_MAGNITUDE ? 0 :
+        STEP_ERROR * magnitude;
+}
 #endif
@@ -0,0 +1,451 @@
+#include "quadric.h"
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+
+/* Scanline rasterization. For fixed (x, y), F and every probe is_surface
+ * takes are quadratics in z (see row), so their signs only change at
+ * roots that have a closed form. Around each root, and around the vertex
+ * of a near tangent row, a window of points is classified exactly with
+ * classify_row; in between, every probe keeps its sign, so the whole
+ * segment is classified at once and written as a run of bits. No seed
+ * and no flood fill are involved, so every sheet of the quadric inside
+ * the subspace is rasterized, and rows are independent of each other. */
+
+#define SCAN_SURFACE 0
+#define SCAN_INTERIOR 1
+#define SCAN_EXTERIOR 2
+
+/* Root windows from the 7 probes, one per probe when it is near tangent */
+#define MAX_WINDOWS 14
+
+typedef struct _scanner {
+    subspace *s;
+    const quadric *q;
+    int mode;
+    int positive;
+    int id, num_threads;
+    uint64_t surface_points;
+    uint64_t *surface, *interior;
+    /* If set, accepted points are collected here, bit z - z_min of the
+     * row, instead of being claimed */
+    uint64_t *out;
+    /* Batches only: the quadrics, 6 bounds per quadric as in
+     * quadric_bounds, how rows are combined, and per thread buffers for
+     * the quadrics overlapping a tile and for the rows being combined */
+    const quadric *qs;
+    size_t num_quadrics;
+    const int64_t *boxes;
+    int op;
+    int32_t *labels;
+    size_t *active;
+    uint64_t *row, *acc;
+} scanner;
+
+/* Adds the range of z where t = z + dz is within width of center, clipped
+ * to [lo, hi) */
+static int add_window(double center, double width, double dz, int64_t lo,
+        int64_t hi, span *w) {
+    double from = floor(center - dz - width), to = floor(center - dz + width);
+    if (!(from == from && to == to) || isinf(width)) {
+        w->lo = lo;
+        w->hi = hi;
+        return 1;
+    }
+    if (to < lo || from >= hi)
+        return 0;
+    w->lo = from < lo ? lo : (int64_t)from;
+    w->hi = to + 1 > hi ? hi : (int64_t)to + 1;
+    return 1;
+}
+
+/* Adds to w the ranges of the row where c t^2 + b t + k, t = z + dz, may
+ * be 0, within the row's tolerance of 0, or change sign. Returns how many
+ * ranges were added */
+static int probe_windows(const row *r, double b, double k, double dz,
+        int64_t lo, int64_t hi, span *w) {
+    double c = r->c, tol = r->tol;
+    if (c == 0) {
+        if (b == 0) {
+            if (fabs(k) > tol)
+                return 0;
+            w->lo = lo;
+            w->hi = hi;
+            return 1;
+        }
+        return add_window(-k / b, 1 + (tol + 8 * DBL_EPSILON * fabs(k)) /
+                fabs(b), dz, lo, hi, w);
+    }
+    double disc = b * b - 4 * c * k;
+    double dtol = 64 * DBL_EPSILON * (b * b + fabs(4 * c * k)) +
+        4 * fabs(c) * tol;
+    if (disc < -dtol)
+        return 0;
+    /* near tangent, the roots could be anywhere close to the vertex */
+    if (disc <= dtol)
+        return add_window(-b / (2 * c), 1 + sqrt(fabs(disc) + dtol) /
+                (2 * fabs(c)), dz, lo, hi, w);
+    double sq = sqrt(disc), half = -0.5 * (b + copysign(sq, b));
+    double roots[2] = {half / c, k / half};
+    int i, n = 0;
+    for (i = 0; i < 2; i++)
+        n += add_window(roots[i], 1 + (tol + dtol / (4 * fabs(c))) / sq +
+                8 * DBL_EPSILON * fabs(roots[i]), dz, lo, hi, w + n);
+    return n;
+}
+
+/* Evaluates the 7 probes at z and stores whether each is positive. Returns
+ * 0 if one of them is too close to 0 to trust */
+static int probe_signs(const row *r, int64_t z, int *positive) {
+    double t[7] = {(double)z, (double)z, (double)z, (double)z, (double)z,
+        z + 0.5, z - 0.5};
+    int p;
+    for (p = 0; p < 7; p++) {
+        int i = p < ROW_PROBES ? p : 0;
+        double v = (r->c * t[p] + r->b[i]) * t[p] + r->k[i];
+        if (fabs(v) <= r->tol || v == 0.0)
+            return 0;
+        positive[p] = v > 0.0;
+    }
+    return 1;
+}
+
+/* Classifies the segment [lo, hi) of the row, which holds no root window,
+ * from the probe signs at its ends. Returns -1 if it has to be classified
+ * point by point after all, otherwise whether its points are accepted */
+static int classify_segment(const scanner *sc, const row *r, int64_t lo,
+        int64_t hi) {
+    int first[7], last[7], p;
+    if (!probe_signs(r, lo, first) || !probe_signs(r, hi - 1, last))
+        return -1;
+    for (p = 0; p < 7; p++)
+        if (first[p] != last[p])
+            return -1;
+    int surface = first[1] != first[2] || first[3] != first[4] ||
+        first[5] != first[6];
+    if (sc->mode == SCAN_INTERIOR)
+        return surface || !first[0];
+    if (sc->mode == SCAN_EXTERIOR)
+        return surface || first[0];
+    return surface;
+}
+
+/* Sets the n bits from bit from on */
+static void set_bits(uint64_t *words, uint64_t from, uint64_t n) {
+    while (n) {
+        uint64_t len = 64 - from % 64 < n ? 64 - from % 64 : n;
+        words[from / 64] |= (len == 64 ? ~(uint64_t)0 : point_bit(len) - 1)
+            << from % 64;
+        from += len;
+        n -= len;
+    }
+}
+
+/* Claims, or collects, the n accepted points from (x, y, z) on */
+static void accept_run(scanner *sc, int64_t x, int64_t y, int64_t z,
+        uint64_t n) {
+    if (sc->out)
+        set_bits(sc->out, z - sc->s->z_min, n);
+    else
+        sc->surface_points += claim_run(sc->s, x, y, z, n, sc->positive);
+}
+
+/* Classifies [lo, hi) point by point and accepts the accepted runs */
+static void classify_window(scanner *sc, int64_t x, int64_t y, int64_t lo,
+        int64_t hi) {
+    size_t n = hi - lo, i, words = bitfield_words(n);
+    classify_row(sc->q, x, y, lo, n, sc->surface, sc->interior);
+    for (i = 0; i < words; i++) {
+        uint64_t accepted = sc->surface[i];
+        if (sc->mode == SCAN_INTERIOR)
+            accepted |= sc->interior[i];
+        else if (sc->mode == SCAN_EXTERIOR)
+            accepted |= ~sc->interior[i];
+        if (i == words - 1 && n % 64)
+            accepted &= point_bit(n % 64) - 1;
+        /* claim each run of accepted points in one go */
+        while (accepted) {
+            int start = __builtin_ctzll(accepted);
+            uint64_t rest = ~accepted & (~(uint64_t)0 << start);
+            int end = rest ? __builtin_ctzll(rest) : 64;
+            accept_run(sc, x, y, lo + 64 * i + start, end - start);
+            accepted &= end == 64 ? 0 : ~(uint64_t)0 << end;
+        }
+    }
+}
+
+/* Rasterizes the points lo <= z < hi of row (x, y) */
+static void rasterize_row(scanner *sc, int64_t x, int64_t y, int64_t lo,
+        int64_t hi) {
+    row r;
+    row_init(&r, sc->q, x, y, lo, hi - lo);
+
+    span w[MAX_WINDOWS], tmp;
+    int n = 0, p, i, j;
+    for (p = 0; p < ROW_PROBES; p++)
+        n += probe_windows(&r, r.b[p], r.k[p], 0, lo, hi, w + n);
+    n += probe_windows(&r, r.b[0], r.k[0], 0.5, lo, hi, w + n);
+    n += probe_windows(&r, r.b[0], r.k[0], -0.5, lo, hi, w + n);
+    for (i = 1; i < n; i++)
+        for (j = i; j > 0 && w[j].lo < w[j - 1].lo; j--) {
+            tmp = w[j];
+            w[j] = w[j - 1];
+            w[j - 1] = tmp;
+        }
+
+    int64_t z = lo;
+    for (i = 0; z < hi; i++) {
+        /* the segment up to the next window */
+        int64_t end = i < n ? w[i].lo : hi;
+        if (end > z) {
+            int accepted = classify_segment(sc, &r, z, end);
+            if (accepted < 0)
+                classify_window(sc, x, y, z, end);
+            else if (accepted)
+                accept_run(sc, x, y, z, end - z);
+            z = end;
+        }
+        if (i >= n)
+            break;
+        /* the window itself, merged with any that overlap it */
+        end = w[i].hi;
+        while (i + 1 < n && w[i + 1].lo <= end) {
+            i++;
+            if (w[i].hi > end)
+                end = w[i].hi;
+        }
+        if (end > z) {
+            classify_window(sc, x, y, z, end);
+            z = end;
+        }
+    }
+}
+
+static void *scan(void *args) {
+    scanner *sc = (scanner *)args;
+    subspace *s = sc->s;
+    int64_t x, y;
+    for (x = s->x_min + sc->id; x < s->x_max; x += sc->num_threads)
+        for (y = s->y_min; y < s->y_max; y++)
+            rasterize_row(sc, x, y, s->z_min, s->z_max);
+    stat_flush();
+    return NULL;
+}
+
+/* Rows are tiled TILE_SIDE a side for batches, so that the quadrics
+ * overlapping a tile are only looked up once for all of its rows */
+#define TILE_SIDE 32
+
+/* Records the label of the points set in fresh, bit i standing for
+ * (x, y, z_min + 64 * word + i) */
+static void label_points(scanner *sc, int64_t x, int64_t y, size_t word,
+        uint64_t fresh, int32_t label) {
+    subspace *s = sc->s;
+    for (; fresh; fresh &= fresh - 1)
+        sc->labels[_index(s, x, y, s->z_min + 64 * (int64_t)word +
+                __builtin_ctzll(fresh))] = label;
+}
+
+/* Combines the rows of every quadric overlapping the row into acc and
+ * claims the result */
+static void rasterize_batch_row(scanner *sc, int64_t x, int64_t y,
+        size_t num_active) {
+    subspace *s = sc->s;
+    size_t words = bitfield_words(s->z_max - s->z_min), a, i;
+    int started = 0;
+    for (a = 0; a < num_active; a++) {
+        size_t k = sc->active[a];
+        const int64_t *box = sc->boxes + 6 * k;
+        if (x < box[0] || x >= box[3] || y < box[1] || y >= box[4]) {
+            if (sc->op != BATCH_INTERSECTION)
+                continue;
+            /* one quadric missing the row empties it */
+            return;
+        }
+        memset(sc->row, 0, words * sizeof(uint64_t));
+        sc->q = &sc->qs[k];
+        sc->out = sc->row;
+        rasterize_row(sc, x, y, box[2], box[5]);
+        for (i = 0; i < words; i++) {
+            uint64_t bits = sc->row[i];
+            if (!started)
+                sc->acc[i] = 0;
+            if (sc->op == BATCH_INTERSECTION)
+                sc->acc[i] = started ? sc->acc[i] & bits : bits;
+            else if (sc->op == BATCH_LABEL && (bits & ~sc->acc[i]))
+                label_points(sc, x, y, i, bits & ~sc->acc[i], k);
+            if (sc->op != BATCH_INTERSECTION)
+                sc->acc[i] |= bits;
+        }
+        started = 1;
+    }
+    if (!started)
+        return;
+    sc->out = NULL;
+    for (i = 0; i < words; i++) {
+        uint64_t accepted = sc->acc[i];
+        while (accepted) {
+            int start = __builtin_ctzll(accepted);
+            uint64_t rest = ~accepted & (~(uint64_t)0 << start);
+            int end = rest ? __builtin_ctzll(rest) : 64;
+            accept_run(sc, x, y, s->z_min + 64 * i + start, end - start);
+            accepted &= end == 64 ? 0 : ~(uint64_t)0 << end;
+        }
+    }
+}
+
+static void *scan_batch(void *args) {
+    scanner *sc = (scanner *)args;
+    subspace *s = sc->s;
+    int64_t tiles_y = (s->y_max - s->y_min + TILE_SIDE - 1) / TILE_SIDE;
+    int64_t tiles = tiles_y * ((s->x_max - s->x_min + TILE_SIDE - 1) /
+            TILE_SIDE);
+    int64_t t, x, y;
+    size_t k, n;
+    for (t = sc->id; t < tiles; t += sc->num_threads) {
+        int64_t x0 = s->x_min + t / tiles_y * TILE_SIDE;
+        int64_t y0 = s->y_min + t % tiles_y * TILE_SIDE;
+        int64_t x1 = x0 + TILE_SIDE < s->x_max ? x0 + TILE_SIDE : s->x_max;
+        int64_t y1 = y0 + TILE_SIDE < s->y_max ? y0 + TILE_SIDE : s->y_max;
+        /* cull the quadrics whose boxes miss the tile */
+        for (k = n = 0; k < sc->num_quadrics; k++) {
+            const int64_t *box = sc->boxes + 6 * k;
+            if (box[0] < x1 && box[3] > x0 && box[1] < y1 && box[4] > y0 &&
+                    box[2] < box[5])
+                sc->active[n++] = k;
+        }
+        if (!n || (sc->op == BATCH_INTERSECTION && n < sc->num_quadrics))
+            continue;
+        for (x = x0; x < x1; x++)
+            for (y = y0; y < y1; y++)
+                rasterize_batch_row(sc, x, y, n);
+    }
+    stat_flush();
+    return NULL;
+}
+
+/* Runs work on num_threads copies of proto. Rows of a thread that cannot
+ * be started are scanned by the caller */
+static int scanline(subspace *s, const scanner *proto, 
+        void *(*work)(void *), int num_threads) {
+    if (num_threads < 1)
+        num_threads = 1;
+    size_t words = bitfield_words(s->z_max - s->z_min);
+    stat_start(start);
+    scanner *scanners = (scanner *)calloc(num_threads, sizeof(scanner));
+    pthread_t *threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    int i, ok = scanners && threads;
+    for (i = 0; ok && i < num_threads; i++) {
+        scanners[i] = *proto;
+        scanners[i].s = s;
+        scanners[i].id = i;
+        scanners[i].num_threads = num_threads;
+        scanners[i].surface = (uint64_t *)malloc(words * sizeof(uint64_t));
+        scanners[i].interior = (uint64_t *)malloc(words * sizeof(uint64_t));
+        ok = scanners[i].surface && scanners[i].interior;
+        if (ok && proto->num_quadrics) {
+            scanners[i].active = (size_t *)malloc(proto->num_quadrics *
+                    sizeof(size_t));
+            scanners[i].row = (uint64_t *)malloc(words * sizeof(uint64_t));
+            scanners[i].acc = (uint64_t *)malloc(words * sizeof(uint64_t));
+            ok = scanners[i].active && scanners[i].row && scanners[i].acc;
+        }
+    }
+
+    int started = 1;
+    if (ok) {
+        for (i = 1; i < num_threads; i++, started++)
+            if (pthread_create(&threads[i], NULL, work, &scanners[i]))
+                break;
+        work(&scanners[0]);
+        for (i = started; i < num_threads; i++)
+            work(&scanners[i]);
+        for (i = 1; i < started; i++)
+            pthread_join(threads[i], NULL);
+    }
+
+    uint64_t surface_points = 0;
+    for (i = 0; scanners && i < num_threads; i++) {
+        surface_points += scanners[i].surface_points;
+        free(scanners[i].surface);
+        free(scanners[i].interior);
+        if (proto->num_quadrics) {
+            free(scanners[i].active);
+            free(scanners[i].row);
+            free(scanners[i].acc);
+        }
+    }
+    __atomic_fetch_add(&s->points_plotted, surface_points, __ATOMIC_RELAXED);
+    free(scanners);
+    free(threads);
+    stat_add(traversals, 1);
+    stat_stop(traverse_ns, start);
+    stat_flush();
+    return ok && !sparse_exhausted(s);
+}
+
+/* Plots every surface point of q inside s, row by row, using num_threads
+ * threads. Only the points plotted are claimed. Returns 0 if the row
+ * buffers could not be allocated or a sparse s ran out of memory */
+int scanline_surface(subspace *s, const quadric *q, int positive,
+        int num_threads) {
+    scanner proto;
+    memset(&proto, 0, sizeof(proto));
+    proto.q = q;
+    proto.mode = SCAN_SURFACE;
+    proto.positive = positive;
+    return scanline(s, &proto, scan, num_threads);
+}
+
+/* Plots every surface point of q inside s together with the interior
+ * (F <= 0), or the exterior (F > 0) if exterior is nonzero */
+int scanline_fill(subspace *s, const quadric *q, int positive, int exterior,
+        int num_threads) {
+    scanner proto;
+    memset(&proto, 0, sizeof(proto));
+    proto.q = q;
+    proto.mode = exterior ? SCAN_EXTERIOR : SCAN_INTERIOR;
+    proto.positive = positive;
+    return scanline(s, &proto, scan, num_threads);
+}
+
+/* Rasterizes num_quadrics quadrics into s in one pass, tile by tile, each
+ * tile only looking at the quadrics whose bounding boxes overlap it. The
+ * surfaces of the quadrics, or with surface 0 the solids (surface and
+ * F <= 0), are combined according to op:
+ *
+ * BATCH_UNION plots the points in any of them,
+ * BATCH_INTERSECTION the points in all of them,
+ * BATCH_LABEL plots like BATCH_UNION and also sets labels[_index(s, x, y,
+ * z)] to the index of the first quadric holding each point. labels must
+ * then have index_space(s) entries; the others are left alone.
+ *
+ * Returns 0 if the bounds or row buffers could not be allocated or a
+ * sparse s ran out of memory */
+int scanline_batch(subspace *s, const quadric *qs, size_t num_quadrics,
+        int op, int surface, int positive, int32_t *labels, 
+        int num_threads) {
+    if (!num_quadrics)
+        return 1;
+    int64_t *boxes = (int64_t *)malloc(6 * num_quadrics * sizeof(int64_t));
+    if (!boxes)
+        return 0;
+    size_t k;
+    for (k = 0; k < num_quadrics; k++)
+        if (!quadric_bounds(&qs[k], s, surface, boxes + 6 * k))
+            boxes[6 * k + 5] = boxes[6 * k + 2];
+    scanner proto;
+    memset(&proto, 0, sizeof(proto));
+    proto.mode = surface ? SCAN_SURFACE : SCAN_INTERIOR;
+    proto.positive = positive;
+    proto.qs = qs;
+    proto.num_quadrics = num_quadrics;
+    proto.boxes = boxes;
+    proto.op = op;
+    proto.labels = labels;
+    int ok = scanline(s, &proto, scan_batch, num_threads);
+    free(boxes);
+    return ok;
+}
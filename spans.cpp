@@ -0,0 +1,316 @@
+#include "quadric.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Span encoding of frozen subspaces. Conversions scan a row at a time, a
+ * word of bits at a step, or a byte for the byte fields of frozen
+ * subspaces, and the boolean operations merge the two sorted span lists of
+ * each row, so their cost follows the number of spans rather than the
+ * volume. */
+
+static span_subspace *span_subspace_init(int64_t x_min, int64_t y_min,
+        int64_t z_min, int64_t x_max, int64_t y_max, int64_t z_max) {
+    span_subspace *sp = (span_subspace *)malloc(sizeof(span_subspace));
+    if (!sp)
+        return NULL;
+    sp->x_min = x_min;
+    sp->y_min = y_min;
+    sp->z_min = z_min;
+    sp->x_max = x_max;
+    sp->y_max = y_max;
+    sp->z_max = z_max;
+    sp->num_spans = 0;
+    sp->spans = NULL;
+    sp->rows = (uint64_t *)malloc((num_rows(sp) + 1) * sizeof(uint64_t));
+    if (!sp->rows) {
+        free(sp);
+        return NULL;
+    }
+    return sp;
+}
+
+void span_subspace_free(span_subspace *sp) {
+    free(sp->rows);
+    free(sp->spans);
+    free(sp);
+}
+
+/* Appends [lo, hi) to the row starting at spans[row], merging it with the
+ * last span of the row if they touch */
+static int push_span(span_subspace *sp, uint64_t *capacity, uint64_t row,
+        int64_t lo, int64_t hi) {
+    if (sp->num_spans > row && sp->spans[sp->num_spans - 1].hi >= lo) {
+        if (hi > sp->spans[sp->num_spans - 1].hi)
+            sp->spans[sp->num_spans - 1].hi = hi;
+        return 1;
+    }
+    if (sp->num_spans == *capacity) {
+        uint64_t grown = *capacity ? 2 * *capacity : 1024;
+        span *spans = (span *)realloc(sp->spans, grown * sizeof(span));
+        if (!spans)
+            return 0;
+        sp->spans = spans;
+        *capacity = grown;
+    }
+    sp->spans[sp->num_spans].lo = lo;
+    sp->spans[sp->num_spans].hi = hi;
+    sp->num_spans++;
+    return 1;
+}
+
+/* Appends the runs of set bits of a row */
+static int push_bits(span_subspace *sp, uint64_t *capacity, uint64_t row,
+        const uint64_t *bits) {
+    uint64_t n = sp->z_max - sp->z_min, i;
+    for (i = 0; i < bitfield_words(n); i++) {
+        uint64_t word = bits[i];
+        while (word) {
+            int start = __builtin_ctzll(word);
+            uint64_t rest = ~word & (~(uint64_t)0 << start);
+            int end = rest ? __builtin_ctzll(rest) : 64;
+            if (!push_span(sp, capacity, row, sp->z_min + 64 * i + start,
+                        sp->z_min + 64 * i + end))
+                return 0;
+            word &= end == 64 ? 0 : ~(uint64_t)0 << end;
+        }
+    }
+    return 1;
+}
+
+/* Gives back the memory reserved for spans that were never used */
+static span_subspace *finish(span_subspace *sp) {
+    span *spans = (span *)realloc(sp->spans,
+            (sp->num_spans + 1) * sizeof(span));
+    if (spans)
+        sp->spans = spans;
+    return sp;
+}
+
+/* Span encoding of the plotted points of s, whatever its layout. Returns
+ * NULL if it could not be allocated */
+span_subspace *subspace_spans(const subspace *s) {
+    span_subspace *sp = span_subspace_init(s->x_min, s->y_min, s->z_min,
+            s->x_max, s->y_max, s->z_max);
+    uint64_t n = s->z_max - s->z_min, words = bitfield_words(n);
+    uint64_t *bits = (uint64_t *)malloc((words + 1) * sizeof(uint64_t));
+    uint64_t capacity = 0, row = 0, i;
+    int64_t x, y, z;
+    if (!sp || !bits)
+        goto fail;
+    for (x = s->x_min; x < s->x_max; x++) {
+        for (y = s->y_min; y < s->y_max; y++, row++) {
+            sp->rows[row] = sp->num_spans;
+            if (!s->bricks && !s->brick_shift) {
+                /* row major, so the row is one run of bits */
+                uint64_t from = _index(s, x, y, s->z_min);
+                int shift = from % 64;
+                const uint64_t *src = s->plotted + from / 64;
+                for (i = 0; i < words; i++)
+                    bits[i] = shift ? src[i] >> shift |
+                        (64 * (i + 1) - shift < n ?
+                         src[i + 1] << (64 - shift) : 0) : src[i];
+                if (n % 64)
+                    bits[words - 1] &= point_bit(n) - 1;
+            } else {
+                memset(bits, 0, words * sizeof(uint64_t));
+                for (z = s->z_min; z < s->z_max; z++)
+                    if (plotted_point(s, _index(s, x, y, z)))
+                        bits[(z - s->z_min) / 64] |= point_bit(z - s->z_min);
+            }
+            if (!push_bits(sp, &capacity, sp->rows[row], bits))
+                goto fail;
+        }
+    }
+    sp->rows[row] = sp->num_spans;
+    free(bits);
+    return finish(sp);
+
+fail:
+    if (sp)
+        span_subspace_free(sp);
+    free(bits);
+    return NULL;
+}
+
+/* ORs the n bits from bit from of src into dst from bit to on, a byte of
+ * src at a time */
+static void gather_bits(uint64_t *dst, uint64_t to, const uint8_t *src,
+        uint64_t from, uint64_t n) {
+    uint64_t len, chunk;
+    for (; n; n -= len, to += len, from += len) {
+        len = 8 - from % 8 < n ? 8 - from % 8 : n;
+        chunk = (uint64_t)(src[from / 8] >> from % 8) & (point_bit(len) - 1);
+        dst[to / 64] |= chunk << to % 64;
+        if (to % 64 + len > 64)
+            dst[to / 64 + 1] |= chunk >> (64 - to % 64);
+    }
+}
+
+/* Span encoding of a frozen subspace. A row is one run of bits in row
+ * major subspaces and a run per brick otherwise */
+span_subspace *frozen_subspace_spans(const frozen_subspace *f) {
+    span_subspace *sp = span_subspace_init(f->x_min, f->y_min, f->z_min,
+            f->x_max, f->y_max, f->z_max);
+    uint64_t n = f->z_max - f->z_min, words = bitfield_words(n);
+    uint64_t side = f->brick_shift ? (uint64_t)1 << f->brick_shift : n;
+    uint64_t *bits = (uint64_t *)malloc((words + 1) * sizeof(uint64_t));
+    uint64_t capacity = 0, row = 0, len;
+    int64_t x, y, z;
+    if (!sp || !bits)
+        goto fail;
+    for (x = f->x_min; x < f->x_max; x++) {
+        for (y = f->y_min; y < f->y_max; y++, row++) {
+            sp->rows[row] = sp->num_spans;
+            memset(bits, 0, (words + 1) * sizeof(uint64_t));
+            for (z = f->z_min; z < f->z_max; z += len) {
+                len = side - (z - f->z_min) % side;
+                if (len > (uint64_t)(f->z_max - z))
+                    len = f->z_max - z;
+                gather_bits(bits, z - f->z_min, f->points,
+                        _index(f, x, y, z), len);
+            }
+            if (!push_bits(sp, &capacity, sp->rows[row], bits))
+                goto fail;
+        }
+    }
+    sp->rows[row] = sp->num_spans;
+    free(bits);
+    return finish(sp);
+
+fail:
+    if (sp)
+        span_subspace_free(sp);
+    free(bits);
+    return NULL;
+}
+
+/* Expands sp into a new row major frozen_subspace */
+frozen_subspace *span_subspace_freeze(const span_subspace *sp) {
+    frozen_subspace *f = (frozen_subspace *)malloc(sizeof(frozen_subspace));
+    if (!f)
+        return NULL;
+    f->x_min = sp->x_min;
+    f->y_min = sp->y_min;
+    f->z_min = sp->z_min;
+    f->x_max = sp->x_max;
+    f->y_max = sp->y_max;
+    f->z_max = sp->z_max;
+    f->brick_shift = f->table_shift = 0;
+    f->pyramid = NULL;
+    f->levels = 0;
+    f->mapping = NULL;
+    f->mapped = 0;
+    f->points = (uint8_t *)calloc((volume(f) + 7) / 8, sizeof(uint8_t));
+    if (!f->points) {
+        free(f);
+        return NULL;
+    }
+    int64_t x, y, z;
+    uint64_t row = 0, i;
+    for (x = sp->x_min; x < sp->x_max; x++)
+        for (y = sp->y_min; y < sp->y_max; y++, row++)
+            for (i = sp->rows[row]; i < sp->rows[row + 1]; i++)
+                for (z = sp->spans[i].lo; z < sp->spans[i].hi; z++) {
+                    uint64_t index = _index(f, x, y, z);
+                    f->points[index / 8] |= 1 << index % 8;
+                }
+    return f;
+}
+
+/* The spans of row (x, y), n is set to how many there are */
+const span *span_row(const span_subspace *sp, int64_t x, int64_t y,
+        size_t *n) {
+    uint64_t row = span_row_index(sp, x, y);
+    *n = sp->rows[row + 1] - sp->rows[row];
+    return sp->spans + sp->rows[row];
+}
+
+/* 1 if (x, y, z) is plotted, by binary search of its row */
+int span_point(const span_subspace *sp, int64_t x, int64_t y, int64_t z) {
+    if (!in_bounds(sp, x, y, z))
+        return 0;
+    size_t n;
+    const span *row = span_row(sp, x, y, &n);
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (row[mid].hi <= z)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < n && row[lo].lo <= z;
+}
+
+/* Number of plotted points */
+uint64_t span_count(const span_subspace *sp) {
+    uint64_t count = 0, i;
+    for (i = 0; i < sp->num_spans; i++)
+        count += sp->spans[i].hi - sp->spans[i].lo;
+    return count;
+}
+
+/* Union or intersection of a and b, row by row. Both must have the same
+ * bounds */
+static span_subspace *combine(const span_subspace *a, const span_subspace *b,
+        int intersect) {
+    if (a->x_min != b->x_min || a->y_min != b->y_min ||
+            a->z_min != b->z_min || a->x_max != b->x_max ||
+            a->y_max != b->y_max || a->z_max != b->z_max)
+        return NULL;
+    span_subspace *sp = span_subspace_init(a->x_min, a->y_min, a->z_min,
+            a->x_max, a->y_max, a->z_max);
+    if (!sp)
+        return NULL;
+    uint64_t capacity = 0, row, i, j;
+    int ok = 1;
+    for (row = 0; ok && row < num_rows(sp); row++) {
+        uint64_t start = sp->rows[row] = sp->num_spans;
+        i = a->rows[row];
+        j = b->rows[row];
+        while (ok && i < a->rows[row + 1] && j < b->rows[row + 1]) {
+            const span *p = &a->spans[i], *q = &b->spans[j];
+            if (intersect) {
+                int64_t lo = p->lo > q->lo ? p->lo : q->lo;
+                int64_t hi = p->hi < q->hi ? p->hi : q->hi;
+                if (lo < hi)
+                    ok = push_span(sp, &capacity, start, lo, hi);
+                if (p->hi < q->hi)
+                    i++;
+                else
+                    j++;
+            } else if (p->lo < q->lo) {
+                ok = push_span(sp, &capacity, start, p->lo, p->hi);
+                i++;
+            } else {
+                ok = push_span(sp, &capacity, start, q->lo, q->hi);
+                j++;
+            }
+        }
+        /* what is left of either row only counts for unions */
+        for (; ok && !intersect && i < a->rows[row + 1]; i++)
+            ok = push_span(sp, &capacity, start, a->spans[i].lo,
+                    a->spans[i].hi);
+        for (; ok && !intersect && j < b->rows[row + 1]; j++)
+            ok = push_span(sp, &capacity, start, b->spans[j].lo,
+                    b->spans[j].hi);
+    }
+    if (!ok) {
+        span_subspace_free(sp);
+        return NULL;
+    }
+    sp->rows[row] = sp->num_spans;
+    return finish(sp);
+}
+
+/* Points plotted in a or b, NULL if the bounds differ or on allocation
+ * failure */
+span_subspace *span_union(const span_subspace *a, const span_subspace *b) {
+    return combine(a, b, 0);
+}
+
+/* Points plotted in both a and b */
+span_subspace *span_intersection(const span_subspace *a,
+        const span_subspace *b) {
+    return combine(a, b, 1);
+}
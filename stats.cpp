@@ -0,0 +1,71 @@
+#include "quadric.h"
+#include <string.h>
+
+/* Counters of the engines. Each thread counts into its own local_stats
+ * without synchronization; quadric_stats_flush moves them into the thread's
+ * running totals and into the process wide ones, which take atomic adds,
+ * once per traversal rather than once per point. Without QUADRIC_STATS
+ * there is nothing to count and every query reads zeros. */
+
+#define STATS_FIELDS (sizeof(quadric_stats) / sizeof(uint64_t))
+
+#ifdef QUADRIC_STATS
+__thread quadric_stats local_stats;
+static __thread quadric_stats thread_stats;
+static quadric_stats total_stats;
+#endif
+
+/* Adds what the calling thread counted since its last flush to the totals */
+void quadric_stats_flush(void) {
+#ifdef QUADRIC_STATS
+    uint64_t *local = (uint64_t *)&local_stats;
+    uint64_t *thread = (uint64_t *)&thread_stats;
+    uint64_t *total = (uint64_t *)&total_stats;
+    size_t i;
+    for (i = 0; i < STATS_FIELDS; i++) {
+        if (!local[i])
+            continue;
+        thread[i] += local[i];
+        __atomic_fetch_add(&total[i], local[i], __ATOMIC_RELAXED);
+        local[i] = 0;
+    }
+#endif
+}
+
+/* Totals over every thread, as of the traversals that have ended */
+void quadric_stats_get(quadric_stats *out) {
+    memset(out, 0, sizeof(quadric_stats));
+#ifdef QUADRIC_STATS
+    uint64_t *total = (uint64_t *)&total_stats;
+    uint64_t *to = (uint64_t *)out;
+    size_t i;
+    for (i = 0; i < STATS_FIELDS; i++)
+        to[i] = __atomic_load_n(&total[i], __ATOMIC_RELAXED);
+#endif
+}
+
+/* What the calling thread has counted, flushed or not */
+void quadric_stats_thread(quadric_stats *out) {
+    memset(out, 0, sizeof(quadric_stats));
+#ifdef QUADRIC_STATS
+    uint64_t *local = (uint64_t *)&local_stats;
+    uint64_t *thread = (uint64_t *)&thread_stats;
+    uint64_t *to = (uint64_t *)out;
+    size_t i;
+    for (i = 0; i < STATS_FIELDS; i++)
+        to[i] = thread[i] + local[i];
+#endif
+}
+
+/* Clears the totals and the calling thread's counters. Other threads keep
+ * what they have not flushed yet */
+void quadric_stats_reset(void) {
+#ifdef QUADRIC_STATS
+    uint64_t *total = (uint64_t *)&total_stats;
+    size_t i;
+    for (i = 0; i < STATS_FIELDS; i++)
+        __atomic_store_n(&total[i], 0, __ATOMIC_RELAXED);
+    memset(&local_stats, 0, sizeof(quadric_stats));
+    memset(&thread_stats, 0, sizeof(quadric_stats));
+#endif
+}
@@ -0,0 +1,100 @@
+#include "stream.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Ring of capacity points. Returns NULL if it could not be allocated */
+point_ring *point_ring_init(size_t capacity) {
+    point_ring *r = (point_ring *)malloc(sizeof(point_ring));
+    if (!r)
+        return NULL;
+    r->points = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+    if (!capacity || !r->points) {
+        free(r->points);
+        free(r);
+        return NULL;
+    }
+    r->capacity = capacity;
+    r->head = r->count = 0;
+    r->closed = r->cancelled = 0;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->not_full, NULL);
+    pthread_cond_init(&r->not_empty, NULL);
+    return r;
+}
+
+void point_ring_free(point_ring *r) {
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->not_full);
+    pthread_cond_destroy(&r->not_empty);
+    free(r->points);
+    free(r);
+}
+
+/* Appends the n points to the ring passed as ctx, waiting for room as
+ * needed. Returns 0 if the consumer cancelled, which stops the traversal */
+int point_ring_visit(void *ctx, const uint64_t *points, size_t n) {
+    point_ring *r = (point_ring *)ctx;
+    pthread_mutex_lock(&r->lock);
+    while (n && !r->cancelled) {
+        if (r->count == r->capacity) {
+            pthread_cond_wait(&r->not_full, &r->lock);
+            continue;
+        }
+        /* up to the end of the free space or of the buffer */
+        size_t tail = (r->head + r->count) % r->capacity;
+        size_t len = r->capacity - r->count;
+        if (len > r->capacity - tail)
+            len = r->capacity - tail;
+        if (len > n)
+            len = n;
+        memcpy(r->points + tail, points, len * sizeof(uint64_t));
+        r->count += len;
+        points += len;
+        n -= len;
+        pthread_cond_signal(&r->not_empty);
+    }
+    int cancelled = r->cancelled;
+    pthread_mutex_unlock(&r->lock);
+    return !cancelled;
+}
+
+/* Tells the consumer no more points are coming */
+void point_ring_close(point_ring *r) {
+    pthread_mutex_lock(&r->lock);
+    r->closed = 1;
+    pthread_cond_broadcast(&r->not_empty);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* Makes the producer stop at its next batch, and drops what is queued */
+void point_ring_cancel(point_ring *r) {
+    pthread_mutex_lock(&r->lock);
+    r->cancelled = 1;
+    r->count = 0;
+    pthread_cond_broadcast(&r->not_full);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* Moves up to max points to out, waiting until there are some. Returns how
+ * many were moved, 0 once the ring is closed and empty */
+size_t point_ring_pop(point_ring *r, uint64_t *out, size_t max) {
+    pthread_mutex_lock(&r->lock);
+    while (!r->count && !r->closed && !r->cancelled)
+        pthread_cond_wait(&r->not_empty, &r->lock);
+    size_t n = 0;
+    while (n < max && r->count) {
+        size_t len = r->capacity - r->head;
+        if (len > r->count)
+            len = r->count;
+        if (len > max - n)
+            len = max - n;
+        memcpy(out + n, r->points + r->head, len * sizeof(uint64_t));
+        r->head = (r->head + len) % r->capacity;
+        r->count -= len;
+        n += len;
+    }
+    if (n)
+        pthread_cond_signal(&r->not_full);
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
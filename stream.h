@@ -0,0 +1,28 @@
+#ifndef STREAM_H
+#define STREAM_H
+#include "quadric.h"
+#include <pthread.h>
+
+/* Bounded ring of packed points between a traversal and a consumer thread.
+ * point_ring_visit is a point_visitor: pass it to stream_surface with the
+ * ring as its context, and it blocks while the ring is full, so the
+ * traversal never gets more than capacity points ahead of the consumer and
+ * memory stays bounded whatever the volume. */
+
+typedef struct _point_ring {
+    uint64_t *points;
+    size_t capacity, head, count;
+    /* Set by the producer once it is done, and by the consumer to make the
+     * producer stop */
+    int closed, cancelled;
+    pthread_mutex_t lock;
+    pthread_cond_t not_full, not_empty;
+} point_ring;
+
+point_ring *point_ring_init(size_t);
+void point_ring_free(point_ring *);
+int point_ring_visit(void *, const uint64_t *, size_t);
+void point_ring_close(point_ring *);
+void point_ring_cancel(point_ring *);
+size_t point_ring_pop(point_ring *, uint64_t *, size_t);
+#endif
@@ -6,7 +6,13 @@
 #include <pthread.h>
 #include <assert.h>
 #include <math.h>
-#include "serialize.h"
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "archive.h"
+#include "tiles.h"
+#include "stream.h"
 
 
 void display_subspace(subspace *);
@@ -14,80 +20,392 @@ void display_frozen_subspace(frozen_subspace *);
 
 void single_thread_benchmark(int64_t);
 void multi_thread_benchmark(int64_t, int);
+void parallel_benchmark(int64_t, int);
+void parallel_test(int64_t, int);
 void find_surface_test(int64_t);
 void herp_test();
-void serialize_test(int64_t);
+void classify_test(int64_t);
+void archive_test(int64_t);
+void span_test(int64_t);
+void pyramid_test(int64_t, int);
+void octree_update_test(int64_t);
+void tiles_test(int64_t);
+void stream_test(int64_t);
+void octree_test(int64_t);
+void scanline_test(int64_t);
+void batch_test(int64_t);
+void stats_test(int64_t);
+void stack_test(int64_t);
 
+/* Timings are for a quick look; bench.cpp has the benchmarks to track */
 int main(int argc, char **argv) {
     //multi_thread_benchmark(19, 32);
     //single_thread_benchmark(19);
+    //parallel_benchmark(256, 32);
     find_surface_test(18);
+    parallel_test(24, 8);
     //herp_test();
-    //serialize_test(64);
+    classify_test(19);
+    archive_test(64);
+    span_test(32);
+    pyramid_test(20, 3500);
+    octree_update_test(40);
+    tiles_test(40);
+    stream_test(24);
+    octree_test(36);
+    scanline_test(36);
+    batch_test(30);
+    stats_test(30);
+    stack_test(60);
 }
 
-void serialize_test(int64_t radius) {
-    subspace *s = subspace_init(-radius - 1, -radius - 1, 
-            -radius - 1, radius + 2, radius + 2, radius + 2);
-    quadric q = {1, 1, 1, 0, 0, 0, 0, 0, 0, -radius * radius};
-    vector surface, v = {0, 0, 0};
-    find_surface(&q, &v, &surface);
-    breadth_first_surface(s, &q, &surface, 1);
-    int points;
-    sem_getvalue(&s->points_plotted, &points);
-    size_t len = volume(s);
-    uint8_t *buf = (uint8_t *)calloc((len + 7) / 8, sizeof(uint8_t));
-    subspace_dump(s, buf, 0, len);
-    FILE *f = fopen("circle64_expected", "w");
-    fwrite(buf, sizeof(char), (len + 7) / 8, f);
-    fclose(f);
-        subspace_serialize(s, "circle64.lzma");
-    frozen_subspace *fs = frozen_subspace_deserialize("circle64.lzma", 
-            0, 0, 0); 
-    int64_t i, j;
-    printf("Subspace:\n");
-    for (i = 0; i < volume(s); i+= 64) {
-        for (j = (i + 63) < (volume(s) - 1) ? 63 : (volume(s) - 1) % 64; j >= 0; j--) {
-            putchar('0' + s->points[i + j].plotted);
+/* Fills an ellipsoid into s, which is freed, writes it slab by slab, then
+ * reads back a range of x that does not start on a slab boundary, and maps
+ * a stored copy of it. A frozen copy written whole must read back as the
+ * same volume */
+static void archive_subspace_test(subspace *s, int64_t radius) {
+    quadric q = {2, 1, 3, 0.5, 0.3, -0.2, 1.1, 0, 0, 
+        (double)(-radius * radius)};
+    scanline_fill(s, &q, 1, 0, 1);
+    archive *a = archive_create("ellipsoid.qsl", s->x_min, s->y_min, 
+            s->z_min, s->x_max, s->y_max, s->z_max, 0);
+    int64_t x, y, z;
+    for (x = s->x_min; x < s->x_max; x += ARCHIVE_SLAB_WIDTH)
+        assert(archive_write_slab(a, s, x));
+    assert(archive_close(a));
+    frozen_subspace *f = archive_read("ellipsoid.qsl", -radius / 2 + 3, 
+            radius / 2);
+    assert(f);
+    size_t mismatches = 0;
+    for (x = f->x_min; x < f->x_max; x++)
+        for (y = f->y_min; y < f->y_max; y++)
+            for (z = f->z_min; z < f->z_max; z++)
+                if ((int)plotted_point(s, _index(s, x, y, z)) != 
+                        frozen_point(f, _index(f, x, y, z)))
+                    mismatches++;
+    printf("%lu mismatches\n", mismatches);
+    assert(!mismatches);
+
+    /* ranges overlapping the archive in part, or not at all */
+    int64_t ranges[][2] = {
+        {s->x_max - 5, s->x_max + 20}, {s->x_min - 30, s->x_min + 3},
+        {s->x_max + 2, s->x_max + 10}, {s->x_min - 30, s->x_min - 5},
+        {s->x_max + 100, s->x_max + 200}, {s->x_min + 9, s->x_min + 4}
+    };
+    size_t r;
+    for (r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+        frozen_subspace *part = archive_read("ellipsoid.qsl", ranges[r][0],
+                ranges[r][1]);
+        assert(part && part->x_min >= s->x_min && 
+                part->x_max <= s->x_max && part->x_min <= part->x_max);
+        assert(part->x_max - part->x_min == 
+                (ranges[r][0] < s->x_max && ranges[r][1] > s->x_min &&
+                 ranges[r][0] < ranges[r][1] ? (ranges[r][1] < s->x_max ?
+                     ranges[r][1] : s->x_max) - (ranges[r][0] > s->x_min ?
+                     ranges[r][0] : s->x_min) : 0));
+        for (x = part->x_min; x < part->x_max; x++)
+            for (y = part->y_min; y < part->y_max; y++)
+                for (z = part->z_min; z < part->z_max; z++)
+                    assert((int)plotted_point(s, _index(s, x, y, z)) == 
+                            frozen_point(part, _index(part, x, y, z)));
+        frozen_subspace_free(part);
+    }
+
+    /* a corrupt slab width must not be trusted */
+    archive_header bad_archive;
+    int afd = open("ellipsoid.qsl", O_RDWR);
+    assert(afd >= 0 && pread(afd, &bad_archive, sizeof(bad_archive), 0) ==
+            sizeof(bad_archive));
+    archive_header good_archive = bad_archive;
+    bad_archive.slab_width = -3;
+    assert(pwrite(afd, &bad_archive, sizeof(bad_archive), 0) ==
+            sizeof(bad_archive));
+    assert(!archive_read("ellipsoid.qsl", s->x_min, s->x_max));
+    bad_archive = good_archive;
+    bad_archive.index = 1 << 30;
+    assert(pwrite(afd, &bad_archive, sizeof(bad_archive), 0) ==
+            sizeof(bad_archive));
+    assert(!archive_read("ellipsoid.qsl", s->x_min, s->x_max));
+    close(afd);
+
+    /* the same range again, mapped rather than read */
+    assert(frozen_subspace_store(f, "ellipsoid.qfz"));
+    frozen_subspace *m = frozen_subspace_map("ellipsoid.qfz");
+    assert(m);
+    for (x = m->x_min; x < m->x_max; x++)
+        for (y = m->y_min; y < m->y_max; y++)
+            for (z = m->z_min; z < m->z_max; z++)
+                assert(frozen_point(m, _index(m, x, y, z)) == 
+                        frozen_point(f, _index(f, x, y, z)));
+    frozen_subspace_free(m);
+
+    /* corrupt or truncated copies must not map */
+    frozen_header header;
+    int fd = open("ellipsoid.qfz", O_RDWR);
+    assert(fd >= 0 && pread(fd, &header, sizeof(header), 0) == 
+            sizeof(header));
+    frozen_header bad = header;
+    bad.brick_shift = 70;
+    assert(pwrite(fd, &bad, sizeof(bad), 0) == sizeof(bad));
+    assert(!frozen_subspace_map("ellipsoid.qfz"));
+    bad = header;
+    bad.z_max = bad.z_min - 1;
+    assert(pwrite(fd, &bad, sizeof(bad), 0) == sizeof(bad));
+    assert(!frozen_subspace_map("ellipsoid.qfz"));
+    assert(pwrite(fd, &header, sizeof(header), 0) == sizeof(header));
+    assert(!ftruncate(fd, header.pyramid));
+    close(fd);
+    assert(!frozen_subspace_map("ellipsoid.qfz"));
+    frozen_subspace_free(f);
+
+    frozen_subspace *frozen = subspace_freeze(s);
+    assert(frozen);
+    a = archive_create("ellipsoid_frozen.qsl", s->x_min, s->y_min, 
+            s->z_min, s->x_max, s->y_max, s->z_max, 5);
+    assert(archive_write_frozen(a, frozen) && archive_close(a));
+    f = archive_read("ellipsoid_frozen.qsl", s->x_min, s->x_max);
+    assert(f);
+    for (x = f->x_min; x < f->x_max; x++)
+        for (y = f->y_min; y < f->y_max; y++)
+            for (z = f->z_min; z < f->z_max; z++)
+                assert(frozen_point(f, _index(f, x, y, z)) == 
+                        (int)plotted_point(s, _index(s, x, y, z)));
+    frozen_subspace_free(f);
+    frozen_subspace_free(frozen);
+    unlink("ellipsoid.qsl");
+    unlink("ellipsoid.qfz");
+    unlink("ellipsoid_frozen.qsl");
+    subspace_free(s);
+}
+
+/* archive_subspace_test for row major, bricked and sparse subspaces */
+void archive_test(int64_t radius) {
+    archive_subspace_test(subspace_init(-radius - 1, -radius - 1, 
+                -radius - 1, radius + 2, radius + 2, radius + 2), radius);
+    archive_subspace_test(subspace_init_layout(-radius - 1, -radius - 1, 
+                -radius - 1, radius + 2, radius + 2, radius + 2, 
+                BRICK_SHIFT), radius);
+    archive_subspace_test(subspace_init_sparse(-radius - 1, -radius - 1, 
+                -radius - 1, radius + 2, radius + 2, radius + 2), radius);
+}
+
+/* Span encoded union and intersection of two solids must match the
+ * point by point result, and frozen copies must encode to the same spans
+ * as the subspaces they were frozen from */
+void span_test(int64_t radius) {
+    quadric q1 = {2, 1, 3, 0.5, 0.3, -0.2, 1.1, 0, 0, 
+        (double)(-radius * radius)};
+    quadric q2 = {1, 1, 1, 0, 0, 0, (double)-radius / 3, 0, 0, 
+        (double)(-radius * radius * 2 / 3)};
+    subspace *a = subspace_init(-radius - 1, -radius - 1, -radius - 1, 
+            radius + 2, radius + 2, radius + 2);
+    subspace *b = subspace_init_layout(-radius - 1, -radius - 1, 
+            -radius - 1, radius + 2, radius + 2, radius + 2, BRICK_SHIFT);
+    scanline_fill(a, &q1, 1, 0, 1);
+    scanline_fill(b, &q2, 1, 0, 1);
+    span_subspace *sa = subspace_spans(a), *sb = subspace_spans(b);
+    span_subspace *u = span_union(sa, sb), *i = span_intersection(sa, sb);
+    assert(sa && sb && u && i);
+    assert(span_count(sa) == a->points_plotted);
+    int64_t x, y, z;
+    size_t mismatches = 0;
+    for (x = a->x_min; x < a->x_max; x++) {
+        for (y = a->y_min; y < a->y_max; y++) {
+            for (z = a->z_min; z < a->z_max; z++) {
+                int in_a = plotted_point(a, _index(a, x, y, z));
+                int in_b = plotted_point(b, _index(b, x, y, z));
+                if (span_point(u, x, y, z) != (in_a | in_b) ||
+                        span_point(i, x, y, z) != (in_a & in_b))
+                    mismatches++;
+            }
         }
-        putchar('\n');
     }
-    printf("\nBuffer:\n");
-    for (i = 0; i < (len  + 7) / 8; i += sizeof(uint64_t)) {
-        printf("%llx\n", *(uint64_t *)(buf + i));
+    printf("%lu spans for %lu points, %lu mismatches\n", u->num_spans, 
+            span_count(u), mismatches);
+    assert(!mismatches);
+
+    const subspace *solids[] = {a, b};
+    const span_subspace *encoded[] = {sa, sb};
+    for (x = 0; x < 2; x++) {
+        frozen_subspace *f = subspace_freeze(solids[x]);
+        span_subspace *sf = frozen_subspace_spans(f);
+        assert(f && sf && sf->num_spans == encoded[x]->num_spans);
+        assert(!memcmp(sf->rows, encoded[x]->rows, 
+                    (num_rows(sf) + 1) * sizeof(uint64_t)));
+        assert(!memcmp(sf->spans, encoded[x]->spans, 
+                    sf->num_spans * sizeof(span)));
+        span_subspace_free(sf);
+        frozen_subspace_free(f);
     }
+    span_subspace_free(sa);
+    span_subspace_free(sb);
+    span_subspace_free(u);
+    span_subspace_free(i);
+    subspace_free(a);
+    subspace_free(b);
+}
 
-    frozen_subspace *s_frozen = freeze_subspace(s);
-    FILE *fsub = fopen("frozen_subspace", "w");
-    fwrite(fs->points, 1, ((fs->x_max - fs->x_min) * (fs->y_max - fs->y_min) * 
-            (fs->z_max - fs->z_min) + 7) / 8, fsub);
-    fclose(fsub);
-    frozen_subspace_serialize(fs, "frozen_subspace_serialize.lzma");
-    frozen_subspace_serialize(fs, "s_frozen_serialize.lzma");
-    frozen_subspace_free(fs);
-    subspace_free(s);
-    frozen_subspace_free(s_frozen);
-    free(buf);
+/* Nonzero if any point lo <= p < hi of f is plotted, point by point */
+static int brute_box(const frozen_subspace *f, const int64_t *lo, 
+        const int64_t *hi) {
+    int64_t x, y, z;
+    for (x = lo[0]; x < hi[0]; x++)
+        for (y = lo[1]; y < hi[1]; y++)
+            for (z = lo[2]; z < hi[2]; z++)
+                if (in_bounds(f, x, y, z) && 
+                        frozen_point(f, _index(f, x, y, z)))
+                    return 1;
+    return 0;
+}
+
+/* frozen_box and frozen_cube against brute_box for num_queries random
+ * boxes and cubes each */
+static void pyramid_queries(const frozen_subspace *f, int num_queries) {
+    int64_t min[3] = {f->x_min, f->y_min, f->z_min};
+    int64_t max[3] = {f->x_max, f->y_max, f->z_max};
+    int64_t lo[3], hi[3], p[3];
+    int i, a, level;
+    for (i = 0; i < num_queries; i++) {
+        /* boxes may stick out of f, and are mostly small */
+        for (a = 0; a < 3; a++) {
+            lo[a] = min[a] - 2 + rand() % (max[a] - min[a] + 4);
+            hi[a] = lo[a] + rand() % (i % 4 ? 6 : max[a] - min[a]);
+        }
+        assert(frozen_box(f, lo, hi) == brute_box(f, lo, hi));
+        level = rand() % 8;
+        for (a = 0; a < 3; a++) {
+            p[a] = min[a] + rand() % (max[a] - min[a]);
+            lo[a] = min[a] + ((p[a] - min[a]) >> level << level);
+            hi[a] = lo[a] + ((int64_t)1 << level);
+        }
+        assert(frozen_cube(f, level, p[0], p[1], p[2]) == 
+                brute_box(f, lo, hi));
+    }
+}
+
+/* Box and cube queries must match a point by point scan without a
+ * pyramid, with one and with one mapped from a file, for row major,
+ * bricked and sparse subspaces. A file whose pyramid has the wrong number
+ * of levels must not map */
+void pyramid_test(int64_t radius, int num_queries) {
+    quadric q = {2, 1, 3, 0.5, 0.3, -0.2, 1.1, 0, 0, 
+        (double)(-radius * radius)};
+    subspace *spaces[] = {
+        subspace_init(-radius - 1, -radius - 3, -radius - 1, radius + 2, 
+                radius + 2, radius + 5),
+        subspace_init_layout(-radius - 1, -radius - 3, -radius - 1, 
+                radius + 2, radius + 2, radius + 5, BRICK_SHIFT),
+        subspace_init_sparse(-radius - 1, -radius - 3, -radius - 1, 
+                radius + 2, radius + 2, radius + 5)
+    };
+    int i;
+    srand(1);
+    for (i = 0; i < 3; i++) {
+        assert(scanline_surface(spaces[i], &q, 1, 1));
+        frozen_subspace *f = subspace_freeze(spaces[i]);
+        assert(f);
+        pyramid_queries(f, num_queries);
+        assert(frozen_subspace_pyramid(f));
+        pyramid_queries(f, num_queries);
+        assert(frozen_subspace_store(f, "pyramid.qfz"));
+        frozen_subspace *m = frozen_subspace_map("pyramid.qfz");
+        assert(m && m->pyramid && m->levels == f->levels);
+        pyramid_queries(m, num_queries);
+        frozen_subspace_free(m);
+
+        frozen_header header;
+        int fd = open("pyramid.qfz", O_RDWR);
+        assert(fd >= 0 && pread(fd, &header, sizeof(header), 0) == 
+                sizeof(header));
+        header.levels++;
+        assert(pwrite(fd, &header, sizeof(header), 0) == sizeof(header));
+        close(fd);
+        assert(!frozen_subspace_map("pyramid.qfz"));
+        unlink("pyramid.qfz");
+        frozen_subspace_free(f);
+        subspace_free(spaces[i]);
+    }
+    printf("%d pyramid queries\n", 18 * num_queries);
+}
+
+/* Every classify_row kernel the CPU has must agree with is_surface and
+ * eval point for point, on an exact quadric and on one that needs the
+ * is_surface fallback */
+void classify_test(int64_t radius) {
+    quadric quadrics[] = {
+        {2, 1, 3, 0.5, 0.3, -0.2, 1.1, 0, 0, (double)(-radius * radius)},
+        {1, 1, -1, 0, 0, 0, 0, 0, 0, (double)(-radius * radius / 4)}
+    };
+    const char *names[] = {"scalar", "avx2", "avx512"};
+    int kernels[] = {CLASSIFY_SCALAR, CLASSIFY_AVX2, CLASSIFY_AVX512};
+    size_t n = 2 * radius + 3;
+    uint64_t *surface = (uint64_t *)malloc(bitfield_words(n) * 
+            sizeof(uint64_t));
+    uint64_t *interior = (uint64_t *)malloc(bitfield_words(n) * 
+            sizeof(uint64_t));
+    int64_t x, y;
+    size_t i, j, mismatches;
+    int k;
+    for (k = 0; k < 3; k++) {
+        if (!classify_row_kernel(kernels[k], &quadrics[0], 0, 0, 0, n, 
+                    surface, interior)) {
+            printf("%s: not supported, skipped\n", names[k]);
+            continue;
+        }
+        mismatches = 0;
+        for (j = 0; j < sizeof(quadrics) / sizeof(quadrics[0]); j++) {
+            const quadric *q = &quadrics[j];
+            for (x = -radius - 1; x < radius + 2; x++) {
+                for (y = -radius - 1; y < radius + 2; y++) {
+                    classify_row_kernel(kernels[k], q, x, y, -radius - 1, 
+                            n, surface, interior);
+                    for (i = 0; i < n; i++) {
+                        vector v = {(double)x, (double)y, 
+                            (double)(-radius - 1 + (int64_t)i)};
+                        if (((surface[i / 64] >> i % 64) & 1) !=
+                                (uint64_t)is_surface(q, &v, BIAS_EXTERIOR) ||
+                                ((interior[i / 64] >> i % 64) & 1) != 
+                                (uint64_t)!(eval(q, &v, BIAS_EXTERIOR) > 0))
+                            mismatches++;
+                    }
+                }
+            }
+        }
+        printf("%s: %lu mismatches\n", names[k], mismatches);
+        assert(!mismatches);
+    }
+    free(surface);
+    free(interior);
 }
 
 void herp_test() {
     quadric q = {1, 1, 1, 0, 0, 0, 0, 0, 0, -19 * 19};
     vector v = {-10, 16, 2};
-    is_surface(&q, &v);
+    is_surface(&q, &v, BIAS_EXTERIOR);
 }
 
+/* A filled sphere traced from a point found by find_surface, frozen */
 void find_surface_test(int64_t radius) {
     subspace *s = subspace_init(-radius - 1, -radius - 1, -radius - 1, radius + 2,
             radius + 2, radius + 2);
-    quadric q = {1, 1, 1, 0, 0, 0, 0, 0, 0, -radius * radius};
+    quadric q = {1, 1, 1, 0, 0, 0, 0, 0, 0, (double)(-radius * radius)};
     vector v = {0, 0, 0};
     vector surface;
-    assert(find_surface(&q, &v, &surface)); 
-    depth_first_fill(s, &q, &surface, 1);
-    subspace_serialize(s, "hello");
-    //frozen_subspace *f = freeze_subspace(s);
-    frozen_subspace *f = frozen_subspace_deserialize("hello", s->x_min, s->y_min, s->z_min);
-    display_frozen_subspace(f);
+    assert(find_surface(&q, &v, &surface, BIAS_EXTERIOR)); 
+    assert(is_surface(&q, &surface, BIAS_EXTERIOR));
+    assert(depth_first_fill(s, &q, &surface, 1, BIAS_EXTERIOR));
+    frozen_subspace *f = subspace_freeze(s);
+    assert(f);
+    int64_t x, y, z;
+    uint64_t points = 0;
+    for (x = s->x_min; x < s->x_max; x++)
+        for (y = s->y_min; y < s->y_max; y++)
+            for (z = s->z_min; z < s->z_max; z++)
+                points += frozen_point(f, _index(f, x, y, z));
+    printf("%lu points filled\n", points);
+    assert(points == s->points_plotted);
+    frozen_subspace_free(f);
+    subspace_free(s);
 }
 
 void print_elem(void *elem) {
@@ -99,20 +417,22 @@ typedef struct _builder_args {
     quadric *q;
     int64_t index;
     int positive;
-    void (*func)(subspace *, const quadric *, const vector *, int);
+    int (*func)(subspace *, const quadric *, const vector *, int, int);
 } builder_args;
 
+#define MAX_SEEDS 1024
+
+/* Each thread starts from its own seed out of those quadric_seeds finds,
+ * spread over the subspace */
 void *builder_thread(void *args) {
     builder_args *bargs = (builder_args *)args;
-    vector v, surface;
-    v.x = _x(bargs->s, bargs->index);
-    v.y = _y(bargs->s, bargs->index);
-    v.z = _z(bargs->s, bargs->index);
-    if(!find_surface(bargs->q, &v, &surface)) {
-        print_vector(&surface);
-        exit(1);
-    }
-    bargs->func(bargs->s, bargs->q, &surface, bargs->positive); 
+    vector seeds[MAX_SEEDS];
+    size_t num_seeds = quadric_seeds(bargs->q, bargs->s, seeds, MAX_SEEDS,
+            BIAS_EXTERIOR);
+    if (num_seeds)
+        bargs->func(bargs->s, bargs->q, &seeds[bargs->index % num_seeds],
+                bargs->positive, BIAS_EXTERIOR); 
+    return NULL;
 }
 
 void multi_thread_benchmark(int64_t radius, int num_threads) {
@@ -132,21 +452,17 @@ void multi_thread_benchmark(int64_t radius, int num_threads) {
     for (i = 0; i < trials; i++) {
         s = subspace_init(-radius - 1, -radius - 1, -radius - 1, radius + 2,
             radius + 2, radius + 2);
-        uint64_t vol = volume(s);
         for (j = 0; j < num_threads; j++) {
             args[j].s = s;
             args[j].q = &q;
             args[j].func = breadth_first_surface;
-            args[j].index = j * vol / num_threads;
+            args[j].index = j * MAX_SEEDS / num_threads;
             args[j].positive = 1;
             pthread_create(&threads[j], NULL, builder_thread, &args[j]);
         }
         for (j = 0; j < num_threads; j++)
             pthread_join(threads[j], NULL);
-        display_subspace(s);
-        int points_plotted;
-        sem_getvalue(&s->points_plotted, &points_plotted);
-        printf("%d points plotted\n", points_plotted);
+        printf("%lu points plotted\n", s->points_plotted);
         subspace_free(s);
     }
     clock_gettime(CLOCK_MONOTONIC, &end);
@@ -160,20 +476,16 @@ void multi_thread_benchmark(int64_t radius, int num_threads) {
     for (i = 0; i < trials; i++) {
         s = subspace_init(-radius - 1, -radius - 1, -radius - 1, radius + 2,
             radius + 2, radius + 2);
-        uint64_t vol = volume(s);
         for (j = 0; j < num_threads; j++) {
             args[j].s = s;
             args[j].q = &q;
             args[j].func = depth_first_surface;
-            args[j].index = j * vol / num_threads;
+            args[j].index = j * MAX_SEEDS / num_threads;
             pthread_create(&threads[j], NULL, builder_thread, &args[j]);
         }
         for (j = 0; j < num_threads; j++)
             pthread_join(threads[j], NULL);
-        display_subspace(s);
-        int points_plotted;
-        sem_getvalue(&s->points_plotted, &points_plotted);
-        printf("%d points plotted\n", points_plotted);
+        printf("%lu points plotted\n", s->points_plotted);
         subspace_free(s);
     }
     clock_gettime(CLOCK_MONOTONIC, &end);
@@ -187,6 +499,613 @@ void multi_thread_benchmark(int64_t radius, int num_threads) {
     free(args);
 }
 
+/* Surface enumeration with the work stealing engine for 1, 2, 4, ...
+ * max_threads threads. Speedup is relative to the single thread run */
+void parallel_benchmark(int64_t radius, int max_threads) {
+    quadric quadrics[] = {
+        {1, 1, 1, 0, 0, 0, 0, 0, 0, (double)(-radius * radius)},
+        {1, 1, -1, 0, 0, 0, 0, 0, 0, 0},
+        {1, 1, -1, 0, 0, 0, 0, 0, 0, (double)(-radius * radius / 4)}
+    };
+    const char *names[] = {"sphere", "cone", "hyperboloid"};
+    struct timespec start, end;
+    int64_t elapsed, single = 0;
+    int i, threads;
+    vector seeds[MAX_SEEDS];
+    for (i = 0; i < 3; i++) {
+        for (threads = 1; threads <= max_threads; threads <<= 1) {
+            subspace *s = subspace_init(-radius - 1, -radius - 1,
+                    -radius - 1, radius + 2, radius + 2, radius + 2);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            size_t num_seeds = quadric_seeds(&quadrics[i], s, seeds,
+                    MAX_SEEDS, BIAS_EXTERIOR);
+            parallel_surface(s, &quadrics[i], seeds, num_seeds, 1,
+                    BIAS_EXTERIOR, threads);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            elapsed = 1000000000 * (uint64_t)(end.tv_sec - start.tv_sec) +
+                    (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec;
+            if (threads == 1)
+                single = elapsed;
+            printf("%s, %d threads: %lu points in %lld nanoseconds, "
+                    "speedup %.2f\n", names[i], threads, s->points_plotted,
+                    elapsed, (double)single / elapsed);
+            subspace_free(s);
+        }
+    }
+}
+
+/* Points of a and b that differ in their plotted bits */
+static uint64_t plotted_mismatches(const subspace *a, const subspace *b) {
+    int64_t x, y, z;
+    uint64_t mismatches = 0;
+    for (x = a->x_min; x < a->x_max; x++)
+        for (y = a->y_min; y < a->y_max; y++)
+            for (z = a->z_min; z < a->z_max; z++)
+                if (plotted_point(a, _index(a, x, y, z)) != 
+                        plotted_point(b, _index(b, x, y, z)))
+                    mismatches++;
+    return mismatches;
+}
+
+/* A subspace over -radius - 1 <= p < radius + 2, row major for layout 0,
+ * in bricks for layout 1 and sparse for layout 2 */
+static subspace *layout_subspace(int layout, int64_t radius) {
+    int64_t lo = -radius - 1, hi = radius + 2;
+    if (layout == 2)
+        return subspace_init_sparse(lo, lo, lo, hi, hi, hi);
+    return subspace_init_layout(lo, lo, lo, hi, hi, hi,
+            layout ? BRICK_SHIFT : 0);
+}
+
+/* Points visited in one of a and b but not the other */
+static uint64_t visited_mismatches(const subspace *a, const subspace *b) {
+    int64_t x, y, z;
+    uint64_t mismatches = 0;
+    for (x = a->x_min; x < a->x_max; x++)
+        for (y = a->y_min; y < a->y_max; y++)
+            for (z = a->z_min; z < a->z_max; z++)
+                if (visited_point(a, _index(a, x, y, z)) != 
+                        visited_point(b, _index(b, x, y, z)))
+                    mismatches++;
+    return mismatches;
+}
+
+/* Plots into expected, over its whole volume, the points a surface (fill 0),
+ * interior fill (1) or exterior fill (2) of q holds according to
+ * is_surface and eval alone */
+static void brute_rasterize(subspace *expected, const quadric *q, int fill) {
+    int64_t x, y, z;
+    for (x = expected->x_min; x < expected->x_max; x++)
+        for (y = expected->y_min; y < expected->y_max; y++)
+            for (z = expected->z_min; z < expected->z_max; z++) {
+                vector v = {(double)x, (double)y, (double)z};
+                int inside = !(eval(q, &v, BIAS_EXTERIOR) > 0);
+                if (is_surface(q, &v, BIAS_EXTERIOR) || 
+                        (fill && inside != (fill == 2)))
+                    expected->points_plotted += claim_run(expected, x, y, z,
+                            1, 1);
+            }
+}
+
+/* Quadrics for the brute force comparisons, down to degenerate and empty
+ * ones */
+static const quadric brute_quadrics[] = {
+    /* sphere, ellipsoid, hyperboloid of one sheet */
+    {1, 1, 1, 0, 0, 0, 0, 0, 0, -400},
+    {2, 1, 3, 0.5, 0.3, -0.2, 1.1, 0, 0, -900},
+    {1, 1, -1, 0, 0, 0, 0, 0, 0, -100},
+    /* cone, cylinder, two parallel planes, a single plane */
+    {1, 1, -1, 0, 0, 0, 0, 0, 0, 0},
+    {1, 0, 1, 0, 0, 0, 0, 0, 0, -150},
+    {1, 0, 0, 0, 0, 0, 0, 0, 0, -49},
+    {0, 0, 0, 0, 0, 0, 1, 0.5, 0, -3.5},
+    /* no real points, and F = 0 everywhere */
+    {1, 1, 1, 0, 0, 0, 0, 0, 0, 5},
+    {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
+};
+
+/* octree_surface and octree_fill must plot exactly the points is_surface
+ * and eval pick out one by one, on every layout */
+void octree_test(int64_t radius) {
+    size_t i;
+    int layout, fill;
+    for (i = 0; i < sizeof(brute_quadrics) / sizeof(brute_quadrics[0]); i++) {
+        const quadric *q = &brute_quadrics[i];
+        for (fill = 0; fill < 3; fill++) {
+            subspace *expected = layout_subspace(0, radius);
+            brute_rasterize(expected, q, fill);
+            for (layout = 0; layout < 3; layout++) {
+                subspace *s = layout_subspace(layout, radius);
+                if (fill)
+                    assert(octree_fill(s, q, 1, fill == 2, 3));
+                else
+                    assert(octree_surface(s, q, 1, 3));
+                assert(s->points_plotted == expected->points_plotted);
+                assert(!plotted_mismatches(s, expected));
+                assert(!visited_mismatches(s, expected));
+                subspace_free(s);
+            }
+            printf("quadric %lu, %s: %lu points\n", i, 
+                    fill ? fill == 2 ? "exterior" : "fill" : "surface", 
+                    expected->points_plotted);
+            subspace_free(expected);
+        }
+    }
+}
+
+/* scanline_surface and scanline_fill must plot exactly the points
+ * is_surface and eval pick out one by one, on every layout. Besides the
+ * brute force quadrics, a cylinder along z has rows that are all surface,
+ * all inside or that miss it, and a sphere larger than the volume rows
+ * whose root window spans the whole row or is empty */
+void scanline_test(int64_t radius) {
+    quadric extra[] = {
+        {1, 1, 0, 0, 0, 0, 0, 0, 0, -150},
+        {1, 1, 1, 0, 0, 0, 0, 0, 0, (double)(-2 * radius * radius)}
+    };
+    size_t num_brute = sizeof(brute_quadrics) / sizeof(brute_quadrics[0]);
+    size_t i;
+    int layout, fill;
+    for (i = 0; i < num_brute + sizeof(extra) / sizeof(extra[0]); i++) {
+        const quadric *q = i < num_brute ? &brute_quadrics[i] : 
+            &extra[i - num_brute];
+        for (fill = 0; fill < 3; fill++) {
+            subspace *expected = layout_subspace(0, radius);
+            brute_rasterize(expected, q, fill);
+            for (layout = 0; layout < 3; layout++) {
+                subspace *s = layout_subspace(layout, radius);
+                if (fill)
+                    assert(scanline_fill(s, q, 1, fill == 2, 3));
+                else
+                    assert(scanline_surface(s, q, 1, 3));
+                assert(s->points_plotted == expected->points_plotted);
+                assert(!plotted_mismatches(s, expected));
+                assert(!visited_mismatches(s, expected));
+                subspace_free(s);
+            }
+            printf("quadric %lu, %s: %lu points\n", i, 
+                    fill ? fill == 2 ? "exterior" : "fill" : "surface", 
+                    expected->points_plotted);
+            subspace_free(expected);
+        }
+    }
+}
+
+/* scanline_batch must plot, point by point, the union or intersection of
+ * what scanline_surface or scanline_fill plot for each quadric alone, and
+ * label each point of the union with the first quadric holding it. A
+ * quadric with no real points empties an intersection */
+void batch_test(int64_t radius) {
+    double r2 = (double)(radius * radius), d = (double)(radius / 3);
+    quadric sets[][3] = {
+        {
+            {1, 1, 1, 0, 0, 0, -2 * d, 0, 0, d * d - r2 / 2},
+            {1, 1, 1, 0, 0, 0, 2 * d, 0, 0, d * d - r2 / 2},
+            {2, 1, 3, 0.5, 0.3, -0.2, 1.1, 0, 0, -r2}
+        },
+        {
+            {1, 1, -1, 0, 0, 0, 0, 0, 0, -r2 / 8},
+            {1, 1, 1, 0, 0, 0, 0, 0, 0, 5},
+            {1, 1, 1, 0, 0, 0, 0, 0, 0, -r2 / 2}
+        }
+    };
+    size_t set, k;
+    int surface, layout, op;
+    int64_t x, y, z;
+    for (set = 0; set < sizeof(sets) / sizeof(sets[0]); set++) {
+        for (surface = 0; surface <= 1; surface++) {
+            subspace *alone[3];
+            for (k = 0; k < 3; k++) {
+                alone[k] = layout_subspace(0, radius);
+                assert(surface ? scanline_surface(alone[k], &sets[set][k], 
+                            1, 2) : scanline_fill(alone[k], &sets[set][k], 
+                            1, 0, 2));
+            }
+            for (layout = 0; layout < 3; layout++) {
+                for (op = BATCH_UNION; op <= BATCH_LABEL; op++) {
+                    subspace *s = layout_subspace(layout, radius);
+                    int32_t *labels = NULL;
+                    if (op == BATCH_LABEL) {
+                        labels = (int32_t *)malloc(index_space(s) * 
+                                sizeof(int32_t));
+                        assert(labels);
+                        memset(labels, 0xff, index_space(s) * 
+                                sizeof(int32_t));
+                    }
+                    assert(scanline_batch(s, sets[set], 3, op, surface, 1, 
+                                labels, 3));
+                    uint64_t points = 0;
+                    for (x = s->x_min; x < s->x_max; x++)
+                        for (y = s->y_min; y < s->y_max; y++)
+                            for (z = s->z_min; z < s->z_max; z++) {
+                                int first = -1, all = 1;
+                                for (k = 0; k < 3; k++) {
+                                    uint64_t index = _index(alone[k], x, y, 
+                                            z);
+                                    int in = plotted_point(alone[k], index) 
+                                        != 0;
+                                    if (in && first < 0)
+                                        first = (int)k;
+                                    all &= in;
+                                }
+                                int expected = op == BATCH_INTERSECTION ? 
+                                    all : first >= 0;
+                                uint64_t index = _index(s, x, y, z);
+                                assert((plotted_point(s, index) != 0) == 
+                                        expected);
+                                if (labels)
+                                    assert(labels[index] == first);
+                                points += expected;
+                            }
+                    assert(s->points_plotted == points);
+                    free(labels);
+                    subspace_free(s);
+                }
+            }
+            for (k = 0; k < 3; k++)
+                subspace_free(alone[k]);
+        }
+        printf("batch %lu: ok\n", set);
+    }
+}
+
+/* Updating an octree rasterization to a new quadric must leave exactly the
+ * points a fresh rasterization of the new quadric plots, whether the
+ * surface moved, grew, shrank, changed shape or stayed put */
+void octree_update_test(int64_t radius) {
+    double r2 = (double)(radius * radius), d = (double)(radius / 4);
+    quadric old_q = {1, 1, 1, 0, 0, 0, 0, 0, 0, -r2 / 2};
+    quadric quadrics[] = {
+        /* moved by d along x and y */
+        {1, 1, 1, 0, 0, 0, -2 * d, -2 * d, 0, 2 * d * d - r2 / 2},
+        /* grown, shrunk */
+        {1, 1, 1, 0, 0, 0, 0, 0, 0, -r2 * 0.8},
+        {1, 1, 1, 0, 0, 0, 0, 0, 0, -r2 / 5},
+        /* unchanged */
+        {1, 1, 1, 0, 0, 0, 0, 0, 0, -r2 / 2},
+        /* a different shape altogether */
+        {2, 1, 3, 0.5, 0.3, -0.2, 1.1, 0, 0, -r2},
+        {1, 1, -1, 0, 0, 0, 0, 0, 0, -r2 / 4}
+    };
+    size_t i;
+    int layout, fill, exterior;
+    for (i = 0; i < sizeof(quadrics) / sizeof(quadrics[0]); i++) {
+        for (layout = 0; layout < 3; layout++) {
+            for (fill = 0; fill < 3; fill++) {
+                exterior = fill == 2;
+                subspace *s = layout_subspace(layout, radius);
+                subspace *expected = layout_subspace(layout, radius);
+                if (fill)
+                    assert(octree_fill(s, &old_q, 1, exterior, 4));
+                else
+                    assert(octree_surface(s, &old_q, 1, 4));
+                assert(octree_update(s, &old_q, &quadrics[i], fill != 0,
+                            exterior, 1, 4));
+                if (fill)
+                    assert(octree_fill(expected, &quadrics[i], 1, exterior,
+                                4));
+                else
+                    assert(octree_surface(expected, &quadrics[i], 1, 4));
+                assert(s->points_plotted == expected->points_plotted);
+                assert(!plotted_mismatches(s, expected));
+                assert(!visited_mismatches(s, expected));
+                subspace_free(s);
+                subspace_free(expected);
+            }
+        }
+        printf("octree update %lu: ok\n", i);
+    }
+}
+
+/* Tiles rasterized by worker processes must read back, point by point and
+ * through tiled_read, as octree_fill plots the whole volume at once. An
+ * index whose bounds are out of order, or a tile file stored in the place
+ * of another, must not open */
+void tiles_test(int64_t radius) {
+    quadric q = {2, 1, 3, 0.5, 0.3, -0.2, 1.1, 0, 0, 
+        (double)(-radius * radius)};
+    subspace *expected = subspace_init(-radius - 1, -radius - 1, 
+            -radius - 1, radius + 2, radius + 2, radius + 2);
+    assert(octree_fill(expected, &q, 1, 0, 1));
+    assert(!mkdir("tiles", 0755) || errno == EEXIST);
+    assert(tiled_rasterize("tiles", &q, expected->x_min, expected->y_min,
+                expected->z_min, expected->x_max, expected->y_max, 
+                expected->z_max, 16, 1, 0, 1, 3));
+    tiled_volume *t = tiled_open("tiles");
+    assert(t);
+    assert(t->points_plotted == expected->points_plotted);
+    int64_t x, y, z;
+    for (x = expected->x_min - 2; x < expected->x_max + 2; x++)
+        for (y = expected->y_min - 2; y < expected->y_max + 2; y++)
+            for (z = expected->z_min - 2; z < expected->z_max + 2; z++)
+                assert(tiled_point(t, x, y, z) == (in_bounds(expected, x,
+                                y, z) && plotted_point(expected,
+                                _index(expected, x, y, z))));
+
+    /* spans several tiles and sticks out of the volume on two sides */
+    int64_t lo[3] = {-radius / 2, -radius - 5, 3};
+    int64_t hi[3] = {radius / 2 + 1, radius / 3, radius + 9};
+    frozen_subspace *f = tiled_read(t, lo, hi);
+    assert(f);
+    assert(f->x_min == lo[0] && f->y_min == expected->y_min && 
+            f->z_min == lo[2]);
+    assert(f->x_max == hi[0] && f->y_max == hi[1] && 
+            f->z_max == expected->z_max);
+    for (x = f->x_min; x < f->x_max; x++)
+        for (y = f->y_min; y < f->y_max; y++)
+            for (z = f->z_min; z < f->z_max; z++)
+                assert((int)frozen_point(f, _index(f, x, y, z)) == 
+                        (int)plotted_point(expected, 
+                            _index(expected, x, y, z)));
+    frozen_subspace_free(f);
+
+    /* a tile file moved over another one */
+    uint64_t tile, first = 0, second = 0;
+    for (tile = 0; tile < tile_count(t); tile++) {
+        if (t->points[tile] && !first)
+            first = tile + 1;
+        else if (t->points[tile] && !second)
+            second = tile + 1;
+    }
+    uint64_t num_tiles = tile_count(t);
+    tiled_close(t);
+    assert(first && second);
+    char path[64], other[64];
+    snprintf(path, sizeof(path), "tiles/tile-%lu.frz", first - 1);
+    snprintf(other, sizeof(other), "tiles/tile-%lu.frz", second - 1);
+    assert(!rename(path, other));
+    assert(!tiled_open("tiles"));
+
+    /* bounds out of order */
+    assert(tiled_rasterize("tiles", &q, expected->x_min, expected->y_min,
+                expected->z_min, expected->x_max, expected->y_max, 
+                expected->z_max, 16, 1, 0, 1, 3));
+    tiled_header header;
+    FILE *index = fopen("tiles/" TILED_INDEX, "r+b");
+    assert(index);
+    assert(fread(&header, sizeof(header), 1, index) == 1);
+    header.y_min = header.y_max + 1;
+    assert(!fseek(index, 0, SEEK_SET));
+    assert(fwrite(&header, sizeof(header), 1, index) == 1);
+    assert(!fclose(index));
+    assert(!tiled_open("tiles"));
+
+    for (tile = 0; tile < num_tiles; tile++) {
+        snprintf(path, sizeof(path), "tiles/tile-%lu.frz", tile);
+        unlink(path);
+    }
+    unlink("tiles/" TILED_INDEX);
+    rmdir("tiles");
+    printf("%lu tiles, %lu points\n", num_tiles, expected->points_plotted);
+    subspace_free(expected);
+}
+
+typedef struct _stream_args {
+    subspace *s;
+    const quadric *q;
+    const vector *seeds;
+    size_t num_seeds;
+    point_ring *ring;
+    int result;
+} stream_args;
+
+void *stream_thread(void *args) {
+    stream_args *a = (stream_args *)args;
+    a->result = stream_surface(a->s, a->q, a->seeds, a->num_seeds, 
+            BIAS_EXTERIOR, point_ring_visit, a->ring);
+    point_ring_close(a->ring);
+    return NULL;
+}
+
+/* Visitor that gives up after a number of batches */
+typedef struct _batch_counter {
+    int batches, limit;
+    uint64_t points;
+} batch_counter;
+
+static int count_batches(void *ctx, const uint64_t *points, size_t n) {
+    batch_counter *c = (batch_counter *)ctx;
+    assert(n && n <= STREAM_BATCH && points);
+    assert(c->batches < c->limit);
+    c->points += n;
+    return ++c->batches < c->limit;
+}
+
+/* Points streamed through a ring far smaller than a batch must be the ones
+ * breadth_first_surface plots, each exactly once. A consumer that cancels
+ * and a visitor that returns 0 must both stop the trace */
+void stream_test(int64_t radius) {
+    quadric quadrics[] = {
+        {1, 1, 1, 0, 0, 0, 0, 0, 0, (double)(-radius * radius)},
+        {1, 1, -1, 0, 0, 0, 0, 0, 0, (double)(-radius * radius / 4)},
+        {2, 1, 3, 0.5, 0.3, -0.2, 1.1, 0, 0, (double)(-radius * radius)}
+    };
+    vector seeds[MAX_SEEDS];
+    uint64_t buffer[5];
+    size_t i, j, n, num_seeds;
+    pthread_t producer;
+    stream_args args;
+    for (i = 0; i < sizeof(quadrics) / sizeof(quadrics[0]); i++) {
+        subspace *expected = layout_subspace(0, radius);
+        num_seeds = quadric_seeds(&quadrics[i], expected, seeds, MAX_SEEDS, 
+                BIAS_EXTERIOR);
+        assert(num_seeds);
+        for (j = 0; j < num_seeds; j++)
+            assert(breadth_first_surface(expected, &quadrics[i], &seeds[j], 
+                        1, BIAS_EXTERIOR));
+
+        subspace *seen = layout_subspace(2, radius);
+        subspace *got = layout_subspace(0, radius);
+        args.s = seen;
+        args.q = &quadrics[i];
+        args.seeds = seeds;
+        args.num_seeds = num_seeds;
+        args.ring = point_ring_init(7);
+        assert(args.ring);
+        assert(!pthread_create(&producer, NULL, stream_thread, &args));
+        while ((n = point_ring_pop(args.ring, buffer, 5))) {
+            assert(n <= 5);
+            for (j = 0; j < n; j++) {
+                int64_t x = unpack_x(seen, buffer[j]);
+                int64_t y = unpack_y(seen, buffer[j]);
+                int64_t z = unpack_z(seen, buffer[j]);
+                assert(claim_run(got, x, y, z, 1, 1) == 1);
+            }
+            got->points_plotted += n;
+        }
+        pthread_join(producer, NULL);
+        assert(args.result);
+        assert(got->points_plotted == expected->points_plotted);
+        assert(!plotted_mismatches(got, expected));
+        point_ring_free(args.ring);
+        subspace_free(seen);
+        subspace_free(got);
+
+        /* the consumer stops after a few points */
+        seen = layout_subspace(2, radius);
+        args.s = seen;
+        args.ring = point_ring_init(7);
+        assert(args.ring);
+        assert(!pthread_create(&producer, NULL, stream_thread, &args));
+        for (j = 0; j < 20; j++)
+            assert(point_ring_pop(args.ring, buffer, 5));
+        point_ring_cancel(args.ring);
+        pthread_join(producer, NULL);
+        assert(!args.result);
+        point_ring_free(args.ring);
+        subspace_free(seen);
+
+        /* the visitor stops after the first batch */
+        seen = layout_subspace(2, radius);
+        batch_counter counter = {0, 1, 0};
+        assert(!stream_surface(seen, &quadrics[i], seeds, num_seeds, 
+                    BIAS_EXTERIOR, count_batches, &counter));
+        assert(counter.batches == 1);
+        assert(counter.points <= STREAM_BATCH);
+        subspace_free(seen);
+
+        printf("quadric %lu: streamed %lu points\n", i, 
+                expected->points_plotted);
+        subspace_free(expected);
+    }
+}
+
+/* After a traversal from one seed the counters must add up: every plotted
+ * point but the seed was an accepted neighbour, and every plotted point had
+ * its 26 neighbours looked at. Built without QUADRIC_STATS they all read
+ * as zeros */
+void stats_test(int64_t radius) {
+    quadric q = {2, 1, 3, 0.5, 0.3, -0.2, 1.1, 0, 0, 
+        (double)(-radius * radius)};
+    vector seeds[MAX_SEEDS];
+    quadric_stats stats, zeros;
+    memset(&zeros, 0, sizeof(zeros));
+    int breadth_first;
+    for (breadth_first = 0; breadth_first <= 1; breadth_first++) {
+        subspace *s = layout_subspace(0, radius);
+        assert(quadric_seeds(&q, s, seeds, MAX_SEEDS, BIAS_EXTERIOR));
+        quadric_stats_reset();
+        assert((breadth_first ? breadth_first_surface : 
+                    depth_first_surface)(s, &q, &seeds[0], 1, 
+                    BIAS_EXTERIOR));
+        quadric_stats_get(&stats);
+#ifdef QUADRIC_STATS
+        assert(stats.traversals == 1);
+        assert(stats.evals + stats.steps);
+        assert(stats.traverse_ns);
+        assert(stats.accepted + 1 == s->points_plotted);
+        assert(stats.out_of_bounds + stats.revisits + stats.rejected + 
+                stats.accepted == 26 * s->points_plotted);
+        printf("%s: %lu accepted, %lu rejected, %lu revisits\n", 
+                breadth_first ? "bfs" : "dfs", stats.accepted, 
+                stats.rejected, stats.revisits);
+#else
+        assert(!memcmp(&stats, &zeros, sizeof(stats)));
+#endif
+        subspace_free(s);
+    }
+}
+
+/* A depth first fill whose stack outgrows stack_limit must fail rather
+ * than grow it. Without a limit, a fill so deep that its stack holds more
+ * points than 64 chunks, far past where a recursive trace would have run
+ * out of call stack, must plot what breadth_first_fill does */
+void stack_test(int64_t radius) {
+    quadric q = {1, 1, 1, 0, 0, 0, 0, 0, 0, (double)(-radius * radius)};
+    vector seeds[MAX_SEEDS];
+    subspace *expected = layout_subspace(0, radius);
+    assert(quadric_seeds(&q, expected, seeds, MAX_SEEDS, BIAS_EXTERIOR));
+    assert(breadth_first_fill(expected, &q, &seeds[0], 1, BIAS_EXTERIOR));
+
+    subspace *s = layout_subspace(0, radius);
+    s->stack_limit = 1;
+    assert(!depth_first_fill(s, &q, &seeds[0], 1, BIAS_EXTERIOR));
+    subspace_free(s);
+    s = layout_subspace(0, radius);
+    s->stack_limit = 64 * 4096 * sizeof(uint64_t);
+    assert(!depth_first_fill(s, &q, &seeds[0], 1, BIAS_EXTERIOR));
+    subspace_free(s);
+
+    s = layout_subspace(0, radius);
+    assert(depth_first_fill(s, &q, &seeds[0], 1, BIAS_EXTERIOR));
+    assert(s->points_plotted == expected->points_plotted);
+    assert(!plotted_mismatches(s, expected));
+    printf("deep fill: %lu points\n", s->points_plotted);
+    subspace_free(s);
+    subspace_free(expected);
+}
+
+/* The work stealing engine must plot exactly the points the breadth first
+ * traversals plot from the same seeds, whatever the number of threads */
+void parallel_test(int64_t radius, int max_threads) {
+    quadric quadrics[] = {
+        {1, 1, 1, 0, 0, 0, 0, 0, 0, (double)(-radius * radius)},
+        {1, 1, -1, 0, 0, 0, 0, 0, 0, 0},
+        {1, 1, -1, 0, 0, 0, 0, 0, 0, (double)(-radius * radius / 4)},
+        {2, 1, 3, 0.5, 0.3, -0.2, 1.1, 0, 0, (double)(-radius * radius)}
+    };
+    vector seeds[MAX_SEEDS];
+    size_t i, j, num_seeds;
+    int threads, fill;
+    for (i = 0; i < sizeof(quadrics) / sizeof(quadrics[0]); i++) {
+        for (fill = 0; fill <= 1; fill++) {
+            subspace *expected = subspace_init(-radius - 1, -radius - 1, 
+                    -radius - 1, radius + 2, radius + 2, radius + 2);
+            num_seeds = quadric_seeds(&quadrics[i], expected, seeds, 
+                    MAX_SEEDS, BIAS_EXTERIOR);
+            assert(num_seeds);
+            for (j = 0; j < num_seeds; j++)
+                assert((fill ? breadth_first_fill : breadth_first_surface)(
+                            expected, &quadrics[i], &seeds[j], 1, 
+                            BIAS_EXTERIOR));
+            for (threads = 1; threads <= max_threads; threads++) {
+                subspace *s = subspace_init_layout(-radius - 1, 
+                        -radius - 1, -radius - 1, radius + 2, radius + 2, 
+                        radius + 2, threads % 2 ? BRICK_SHIFT : 0);
+                assert((fill ? parallel_fill : parallel_surface)(s, 
+                            &quadrics[i], seeds, num_seeds, 1, 
+                            BIAS_EXTERIOR, threads));
+                assert(s->points_plotted == expected->points_plotted);
+                assert(!plotted_mismatches(s, expected));
+                subspace_free(s);
+            }
+            printf("quadric %lu, %s: %lu points\n", i, 
+                    fill ? "fill" : "surface", expected->points_plotted);
+            subspace_free(expected);
+        }
+    }
+
+    /* too tall for pack_point: the traversals refuse rather than plot
+     * wrapped coordinates */
+    subspace *tall = subspace_init_sparse(0, 0, 0, 8, 8, 3000000);
+    quadric plane = {0, 0, 0, 0, 0, 0, 0, 0, 1, -2500000};
+    vector seed = {3, 3, 2500000};
+    assert(!breadth_first_surface(tall, &plane, &seed, 1, BIAS_EXTERIOR));
+    assert(!parallel_surface(tall, &plane, &seed, 1, 1, BIAS_EXTERIOR, 
+                max_threads));
+    subspace_free(tall);
+}
+
 void single_thread_benchmark(int64_t radius) {
     quadric q = {1, 1, 1, 0, 0, 0, 0, 0, 0, -radius * radius};
     int64_t i, trials = 100;
@@ -198,7 +1117,7 @@ void single_thread_benchmark(int64_t radius) {
     for (i = 0; i < trials; i++) {
         s = subspace_init(-radius - 1, -radius - 1, 0, radius + 2,
             radius + 2, 1);
-        breadth_first_surface(s, &q, &v, 1);
+        breadth_first_surface(s, &q, &v, 1, BIAS_EXTERIOR);
         subspace_free(s);
     }
     clock_gettime(CLOCK_MONOTONIC, &end);
@@ -212,7 +1131,7 @@ void single_thread_benchmark(int64_t radius) {
     for (i = 0; i < trials; i++) {
         s = subspace_init(-radius - 1, -radius - 1, 0, radius + 2,
             radius + 2, 1);
-        depth_first_surface(s, &q, &v, 1);
+        depth_first_surface(s, &q, &v, 1, BIAS_EXTERIOR);
         subspace_free(s);
     }
     clock_gettime(CLOCK_MONOTONIC, &end);
@@ -230,7 +1149,7 @@ void display_subspace(subspace *s) {
         clear_all();
         for (j = s->y_max - 1; j >= s->y_min; j--) {
             for (i = s->x_min; i < s->x_max; i++) {
-                printf("%d ", s->points[_index(s, i, j, k)].plotted);
+                printf("%d ", plotted_point(s, _index(s, i, j, k)));
             }
             putchar('\n');
         }
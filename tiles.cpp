@@ -0,0 +1,343 @@
+#include "tiles.h"
+#include "archive.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/* Tiles are handed out through a counter in memory shared by the workers,
+ * so that workers that drew cheap tiles, far from the surface, go on with
+ * the next ones. The number of points of every tile is reported in the
+ * same memory, after the counter. Workers are processes rather than
+ * threads: each only ever holds one tile, and they share nothing else, so
+ * nothing contends and a worker running out of memory only fails its
+ * own tiles. */
+
+typedef struct _tile_queue {
+    uint64_t next;
+    int failed;
+} tile_queue;
+
+/* Where tile is stored. Returns 0 if the path does not fit */
+static int tile_path(char *path, const char *dir, uint64_t tile) {
+    int n = snprintf(path, PATH_MAX, "%s/tile-%lu.frz", dir,
+            (unsigned long)tile);
+    return n > 0 && n < PATH_MAX;
+}
+
+/* Bounds of tile */
+static void tile_bounds(const tiled_volume *t, uint64_t tile, int64_t *lo,
+        int64_t *hi) {
+    int64_t min[3] = {t->x_min, t->y_min, t->z_min};
+    int64_t max[3] = {t->x_max, t->y_max, t->z_max};
+    uint64_t cell[3];
+    int a;
+    cell[2] = tile % num_tiles(t, z);
+    cell[1] = tile / num_tiles(t, z) % num_tiles(t, y);
+    cell[0] = tile / num_tiles(t, z) / num_tiles(t, y);
+    for (a = 0; a < 3; a++) {
+        lo[a] = min[a] + (int64_t)cell[a] * t->tile_side;
+        hi[a] = lo[a] + t->tile_side < max[a] ? lo[a] + t->tile_side :
+            max[a];
+    }
+}
+
+/* Whether f covers exactly the bounds of tile, so that a file stored for
+ * another tile or volume is not read in its place */
+static int tile_matches(const tiled_volume *t, uint64_t tile,
+        const frozen_subspace *f) {
+    int64_t lo[3], hi[3];
+    tile_bounds(t, tile, lo, hi);
+    return f->x_min == lo[0] && f->y_min == lo[1] && f->z_min == lo[2] &&
+        f->x_max == hi[0] && f->y_max == hi[1] && f->z_max == hi[2];
+}
+
+/* Rasterizes and stores tiles until there are none left or one fails */
+static void rasterize_tiles(const char *dir, const quadric *q,
+        const tiled_volume *t, tile_queue *queue, uint64_t *points,
+        int fill, int exterior, int positive) {
+    char path[PATH_MAX];
+    int64_t lo[3], hi[3];
+    uint64_t tile;
+    while (!__atomic_load_n(&queue->failed, __ATOMIC_RELAXED) &&
+            (tile = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED))
+            < tile_count(t)) {
+        tile_bounds(t, tile, lo, hi);
+        subspace *s = subspace_init_layout(lo[0], lo[1], lo[2], hi[0],
+                hi[1], hi[2], BRICK_SHIFT);
+        int ok = s && tile_path(path, dir, tile);
+        if (ok)
+            ok = fill ? octree_fill(s, q, positive, exterior, 1) :
+                octree_surface(s, q, positive, 1);
+        if (ok && s->points_plotted) {
+            frozen_subspace *f = subspace_freeze(s);
+            ok = f && frozen_subspace_store(f, path);
+            if (f)
+                frozen_subspace_free(f);
+        } else if (ok) {
+            /* left over from an earlier run */
+            unlink(path);
+        }
+        if (ok)
+            points[tile] = s->points_plotted;
+        else
+            __atomic_store_n(&queue->failed, 1, __ATOMIC_RELAXED);
+        if (s)
+            subspace_free(s);
+    }
+}
+
+/* Rasterizes q over the given bounds, in tiles of tile_side points a side,
+ * TILED_SIDE if 0, into frozen files and an index in the existing directory
+ * dir, like octree_fill if fill is nonzero and octree_surface otherwise.
+ * The tiles are shared among num_workers processes, the caller being one
+ * of them; tiles of workers that cannot be started are done by the
+ * others. Any index left in dir is removed before the first tile is
+ * handed out, so that tiled_open fails on a run that did not complete
+ * rather than mix its tiles with older ones. Returns 1 once every tile and
+ * the index are written.
+ *
+ * Workers are forked and rasterize with malloc and the octree engine
+ * without exec'ing, which is only safe if the caller is single threaded:
+ * a lock another thread of the caller held at the fork would never be
+ * released in the workers. Call it before starting any thread */
+int tiled_rasterize(const char *dir, const quadric *q, int64_t x_min,
+        int64_t y_min, int64_t z_min, int64_t x_max, int64_t y_max,
+        int64_t z_max, int64_t tile_side, int fill, int exterior,
+        int positive, int num_workers) {
+    tiled_volume t;
+    t.x_min = x_min;
+    t.y_min = y_min;
+    t.z_min = z_min;
+    t.x_max = x_max > x_min ? x_max : x_min;
+    t.y_max = y_max > y_min ? y_max : y_min;
+    t.z_max = z_max > z_min ? z_max : z_min;
+    t.tile_side = tile_side > 0 ? tile_side : TILED_SIDE;
+    if (num_workers < 1)
+        num_workers = 1;
+    char path[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s/" TILED_INDEX, dir) >= PATH_MAX ||
+            (unlink(path) && errno != ENOENT))
+        return 0;
+
+    size_t bytes = sizeof(tile_queue) + tile_count(&t) * sizeof(uint64_t);
+    void *shared = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+        return 0;
+    tile_queue *queue = (tile_queue *)shared;
+    uint64_t *points = (uint64_t *)(queue + 1);
+
+    pid_t *workers = (pid_t *)malloc(num_workers * sizeof(pid_t));
+    int i, started = 0, status;
+    if (!workers) {
+        munmap(shared, bytes);
+        return 0;
+    }
+    fflush(NULL);
+    for (i = 1; i < num_workers; i++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            break;
+        if (!pid) {
+            rasterize_tiles(dir, q, &t, queue, points, fill, exterior,
+                    positive);
+            _exit(0);
+        }
+        workers[started++] = pid;
+    }
+    rasterize_tiles(dir, q, &t, queue, points, fill, exterior, positive);
+    for (i = 0; i < started; i++)
+        if (waitpid(workers[i], &status, 0) < 0 || !WIFEXITED(status) ||
+                WEXITSTATUS(status))
+            queue->failed = 1;
+    free(workers);
+
+    /* a worker that died took its tile with it */
+    int ok = !queue->failed && queue->next >= tile_count(&t);
+    FILE *index = NULL;
+    if (ok)
+        index = fopen(path, "wb");
+    if (index) {
+        tiled_header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TILED_MAGIC, sizeof(header.magic));
+        header.x_min = t.x_min;
+        header.y_min = t.y_min;
+        header.z_min = t.z_min;
+        header.x_max = t.x_max;
+        header.y_max = t.y_max;
+        header.z_max = t.z_max;
+        header.tile_side = t.tile_side;
+        ok = fwrite(&header, sizeof(header), 1, index) == 1 &&
+            fwrite(points, sizeof(uint64_t), tile_count(&t), index) ==
+            tile_count(&t);
+        ok = !fclose(index) && ok;
+    } else {
+        ok = 0;
+    }
+    munmap(shared, bytes);
+    return ok;
+}
+
+/* Maps the tiles written by tiled_rasterize to dir. Pages of the tiles are
+ * only read once they are queried, so the volume may be far larger than
+ * memory. Returns NULL on failure, and if the index bounds are out of order
+ * or a tile file does not cover the bounds of its tile */
+tiled_volume *tiled_open(const char *dir) {
+    char path[PATH_MAX];
+    tiled_header header;
+    if (snprintf(path, PATH_MAX, "%s/" TILED_INDEX, dir) >= PATH_MAX)
+        return NULL;
+    FILE *index = fopen(path, "rb");
+    if (!index)
+        return NULL;
+    tiled_volume *t = (tiled_volume *)malloc(sizeof(tiled_volume));
+    if (!t || fread(&header, sizeof(header), 1, index) != 1 ||
+            memcmp(header.magic, TILED_MAGIC, sizeof(header.magic)) ||
+            header.tile_side <= 0 || header.x_min > header.x_max ||
+            header.y_min > header.y_max || header.z_min > header.z_max) {
+        free(t);
+        fclose(index);
+        return NULL;
+    }
+    t->x_min = header.x_min;
+    t->y_min = header.y_min;
+    t->z_min = header.z_min;
+    t->x_max = header.x_max;
+    t->y_max = header.y_max;
+    t->z_max = header.z_max;
+    t->tile_side = header.tile_side;
+    t->points_plotted = 0;
+    t->points = (uint64_t *)malloc(tile_count(t) * sizeof(uint64_t) + 1);
+    t->tiles = (frozen_subspace **)calloc(tile_count(t) + 1,
+            sizeof(frozen_subspace *));
+    int ok = t->points && t->tiles && fread(t->points, sizeof(uint64_t),
+            tile_count(t), index) == tile_count(t);
+    fclose(index);
+    uint64_t tile;
+    for (tile = 0; ok && tile < tile_count(t); tile++) {
+        t->points_plotted += t->points[tile];
+        if (t->points[tile])
+            ok = tile_path(path, dir, tile) &&
+                (t->tiles[tile] = frozen_subspace_map(path)) &&
+                tile_matches(t, tile, t->tiles[tile]);
+    }
+    if (!ok) {
+        tiled_close(t);
+        return NULL;
+    }
+    return t;
+}
+
+void tiled_close(tiled_volume *t) {
+    uint64_t tile;
+    for (tile = 0; t->tiles && tile < tile_count(t); tile++)
+        if (t->tiles[tile])
+            frozen_subspace_free(t->tiles[tile]);
+    free(t->tiles);
+    free(t->points);
+    free(t);
+}
+
+/* frozen_point for the whole volume, 0 outside of it */
+int tiled_point(const tiled_volume *t, int64_t x, int64_t y, int64_t z) {
+    if (!in_bounds(t, x, y, z))
+        return 0;
+    const frozen_subspace *f = t->tiles[tile_of(t, x, y, z)];
+    return f && frozen_point(f, _index(f, x, y, z));
+}
+
+/* Clips lo <= p < hi to t and finds the tiles it overlaps, first[a] to
+ * last[a] along each axis. Returns 0 if the box misses t */
+static int clip(const tiled_volume *t, const int64_t *lo, const int64_t *hi,
+        int64_t *from, int64_t *to, int64_t *first, int64_t *last) {
+    int64_t min[3] = {t->x_min, t->y_min, t->z_min};
+    int64_t max[3] = {t->x_max, t->y_max, t->z_max};
+    int a, hit = 1;
+    for (a = 0; a < 3; a++) {
+        from[a] = lo[a] > min[a] ? lo[a] : min[a];
+        to[a] = hi[a] < max[a] ? hi[a] : max[a];
+        hit &= from[a] < to[a];
+        first[a] = (from[a] - min[a]) / t->tile_side;
+        last[a] = (to[a] - 1 - min[a]) / t->tile_side;
+    }
+    return hit;
+}
+
+/* frozen_box for the whole volume. Tiles without points are skipped
+ * outright, the others are looked at through their pyramids */
+int tiled_box(const tiled_volume *t, const int64_t *lo, const int64_t *hi) {
+    int64_t from[3], to[3], first[3], last[3], i, j, k;
+    if (!clip(t, lo, hi, from, to, first, last))
+        return 0;
+    for (i = first[0]; i <= last[0]; i++)
+        for (j = first[1]; j <= last[1]; j++)
+            for (k = first[2]; k <= last[2]; k++) {
+                const frozen_subspace *f = t->tiles[((uint64_t)i *
+                        num_tiles(t, y) + j) * num_tiles(t, z) + k];
+                if (f && frozen_box(f, from, to))
+                    return 1;
+            }
+    return 0;
+}
+
+/* Merges the points lo <= p < hi of the volume, clipped to it, into a new
+ * row major frozen_subspace. Returns NULL if it could not be allocated */
+frozen_subspace *tiled_read(const tiled_volume *t, const int64_t *lo,
+        const int64_t *hi) {
+    int64_t from[3], to[3], first[3], last[3], i, j, k, x, y, z;
+    frozen_subspace *out = (frozen_subspace *)malloc(sizeof(frozen_subspace));
+    if (!out)
+        return NULL;
+    if (!clip(t, lo, hi, from, to, first, last)) {
+        /* an empty volume at the clipped corner */
+        for (i = 0; i < 3; i++)
+            to[i] = from[i];
+        first[0] = 0;
+        last[0] = -1;
+    }
+    out->x_min = from[0];
+    out->y_min = from[1];
+    out->z_min = from[2];
+    out->x_max = to[0];
+    out->y_max = to[1];
+    out->z_max = to[2];
+    out->brick_shift = out->table_shift = 0;
+    out->pyramid = NULL;
+    out->levels = 0;
+    out->mapping = NULL;
+    out->mapped = 0;
+    out->points = (uint8_t *)calloc((volume(out) + 7) / 8 + 1, 1);
+    if (!out->points) {
+        free(out);
+        return NULL;
+    }
+    for (i = first[0]; i <= last[0]; i++)
+        for (j = first[1]; j <= last[1]; j++)
+            for (k = first[2]; k <= last[2]; k++) {
+                const frozen_subspace *f = t->tiles[((uint64_t)i *
+                        num_tiles(t, y) + j) * num_tiles(t, z) + k];
+                if (!f)
+                    continue;
+                /* the part of the tile inside the box */
+                int64_t x0 = f->x_min > from[0] ? f->x_min : from[0];
+                int64_t y0 = f->y_min > from[1] ? f->y_min : from[1];
+                int64_t z0 = f->z_min > from[2] ? f->z_min : from[2];
+                int64_t x1 = f->x_max < to[0] ? f->x_max : to[0];
+                int64_t y1 = f->y_max < to[1] ? f->y_max : to[1];
+                int64_t z1 = f->z_max < to[2] ? f->z_max : to[2];
+                for (x = x0; x < x1; x++)
+                    for (y = y0; y < y1; y++)
+                        for (z = z0; z < z1; z++)
+                            if (frozen_point(f, _index(f, x, y, z))) {
+                                uint64_t index = _index(out, x, y, z);
+                                out->points[index / 8] |= 1 << index % 8;
+                            }
+            }
+    return out;
+}
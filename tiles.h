@@ -0,0 +1,51 @@
+#ifndef TILES_H
+#define TILES_H
+#include "quadric.h"
+
+/* Tiled volumes split a bounding volume too large for one address space
+ * into cubes of tile_side points a side, aligned on the lower bounds. Each
+ * tile is rasterized on its own by a worker process and stored as a frozen
+ * file in a directory, and an index file there records the bounds, the
+ * tile side and how many points every tile holds. Tiles without points
+ * have no file. tiled_open maps every tile back and presents them as one
+ * frozen volume. */
+
+#define TILED_MAGIC "QTILES1"
+#define TILED_INDEX "index"
+#define TILED_SIDE 256
+
+#define num_tiles(t, a) (((t)->a##_max - (t)->a##_min + (t)->tile_side - 1) \
+        / (t)->tile_side)
+#define tile_count(t) ((uint64_t)num_tiles(t, x) * num_tiles(t, y) * \
+        num_tiles(t, z))
+#define tile_of(t, px, py, pz) (((uint64_t)(((px) - (t)->x_min) / \
+        (t)->tile_side) * num_tiles(t, y) + \
+        (uint64_t)(((py) - (t)->y_min) / (t)->tile_side)) * \
+        num_tiles(t, z) + (uint64_t)(((pz) - (t)->z_min) / (t)->tile_side))
+
+/* The index starts with this header, followed by the number of points of
+ * each tile, x slowest and z fastest */
+typedef struct _tiled_header {
+    char magic[8];
+    int64_t x_min, y_min, z_min, x_max, y_max, z_max;
+    int64_t tile_side;
+} tiled_header;
+
+typedef struct _tiled_volume {
+    int64_t x_min, y_min, z_min, x_max, y_max, z_max;
+    int64_t tile_side;
+    /* Mapped tiles, NULL for tiles without points */
+    frozen_subspace **tiles;
+    uint64_t *points;
+    uint64_t points_plotted;
+} tiled_volume;
+
+int tiled_rasterize(const char *, const quadric *, int64_t, int64_t,
+        int64_t, int64_t, int64_t, int64_t, int64_t, int, int, int, int);
+tiled_volume *tiled_open(const char *);
+void tiled_close(tiled_volume *);
+int tiled_point(const tiled_volume *, int64_t, int64_t, int64_t);
+int tiled_box(const tiled_volume *, const int64_t *, const int64_t *);
+frozen_subspace *tiled_read(const tiled_volume *, const int64_t *,
+        const int64_t *);
+#endif